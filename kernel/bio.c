@@ -5,6 +5,12 @@
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// The cache starts with NBUF buffers. Once fsinit() knows the
+// size of the log, whose transaction can pin that many blocks,
+// breserve() adds as many more, so that the cache need not grow
+// under load. It still grows a page's worth of buffers at a time
+// if every buffer is in use; such buffers are never freed.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -26,6 +32,8 @@
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  uint bsize;  // block size of the file system
+  int nbuf;    // number of buffers
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -33,25 +41,74 @@ struct {
   struct buf head;
 } bcache;
 
+// Give b a data page and add it to the LRU list as the least
+// recently used buffer. Returns -1 if out of memory.
+// Caller must hold bcache.lock, or be binit().
+static int
+baddbuf(struct buf *b)
+{
+  if((b->data = kalloc()) == 0)
+    return -1;
+  b->size = bcache.bsize;
+  bcache.nbuf++;
+  initsleeplock(&b->lock, "buffer");
+  b->prev = bcache.head.prev;
+  b->next = &bcache.head;
+  bcache.head.prev->next = b;
+  bcache.head.prev = b;
+  return 0;
+}
+
 void
 binit(void)
 {
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  bcache.bsize = BSIZE;  // until fsinit() reads the super block
 
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    if(baddbuf(b) < 0)
+      panic("binit");
   }
 }
 
+// Add a page's worth of new, unused buffers to the cache.
+// Returns -1 if out of memory.
+// Caller must hold bcache.lock.
+static int
+bgrow(void)
+{
+  struct buf *b, *bs;
+
+  if((bs = kalloc()) == 0)
+    return -1;
+  memset(bs, 0, PGSIZE);
+  for(b = bs; b < bs + PGSIZE/sizeof(*b); b++){
+    if(baddbuf(b) < 0){
+      if(b == bs){
+        kfree((char*)bs);
+        return -1;
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+// Grow the cache to at least n buffers, if there is memory.
+void
+breserve(int n)
+{
+  acquire(&bcache.lock);
+  while(bcache.nbuf < n && bgrow() == 0)
+    ;
+  release(&bcache.lock);
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
@@ -73,11 +130,14 @@ bget(uint dev, uint blockno)
   }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
+  // Recycle the least recently used (LRU) unused buffer,
+  // growing the cache if there is none.
+again:
   for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
     if(b->refcnt == 0) {
       b->dev = dev;
       b->blockno = blockno;
+      b->size = bcache.bsize;
       b->valid = 0;
       b->refcnt = 1;
       release(&bcache.lock);
@@ -85,6 +145,8 @@ bget(uint dev, uint blockno)
       return b;
     }
   }
+  if(bgrow() == 0)
+    goto again;
   panic("bget: no buffers");
 }
 
@@ -136,6 +198,34 @@ brelse(struct buf *b)
   release(&bcache.lock);
 }
 
+// Set the block size of the file system on dev to size bytes.
+// Buffers cached at the old size are discarded, so there must
+// be no buffers in use.
+void
+bsetsize(uint dev, uint size)
+{
+  struct buf *b;
+
+  if(size < BSIZE || size > MAXBSIZE || size % BSIZE != 0)
+    panic("bsetsize");
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->refcnt != 0)
+      panic("bsetsize: busy");
+    b->valid = 0;
+    b->size = size;
+  }
+  bcache.bsize = size;
+  release(&bcache.lock);
+}
+
+// Return the block size of the file system on dev.
+uint
+bsize(uint dev)
+{
+  return bcache.bsize;
+}
+
 void
 bpin(struct buf *b) {
   acquire(&bcache.lock);
@@ -3,10 +3,11 @@ struct buf {
   int disk;    // does disk "own" buf?
   uint dev;
   uint blockno;
+  uint size;   // block size (bytes)
   struct sleeplock lock;
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data; // MAXBSIZE bytes
 };
 
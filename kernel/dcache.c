@@ -0,0 +1,278 @@
+// Directory entry cache.
+//
+// The dentry cache remembers the results of dirlookup():
+// which inode the name name in directory dir refers to, or
+// that there is no such name (a negative entry, inum == 0).
+// namex() consults it before locking a directory and reading
+// its blocks, so repeated lookups of the same paths cost no
+// disk reads and no inode sleep-locks.
+//
+// Entries are only made for directories, by dirlookup() and
+// dirlink() while they hold the directory's lock, and code that
+// removes a name from a directory must replace its entry with a
+// negative one before releasing the lock. dcpurge() drops the
+// entries of a directory that is being freed, so a reused inode
+// number never inherits them.
+//
+// Lookups do not take dcache.lock. Changes to a hash chain, or to
+// an entry on it, are made under dcache.lock and bracketed by
+// increments of the chain's sequence count, which is odd while a
+// change is in progress. A reader samples the count, walks the
+// chain, takes a reference to the inode it found, and checks that
+// the count has not moved; if it has, the reader drops what it got
+// and repeats the lookup holding dcache.lock. Since an unlink must
+// change the entry before the inode can be freed, an unchanged
+// count means the reference was taken on the right inode.
+//
+// Interface:
+// * dclookup() to look up a name, returning a referenced inode.
+// * dcenter() to record a name's inode (or its absence).
+// * dcpurge() when a directory's inode is freed.
+
+#include "types.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NDHASH 61
+
+struct dentry {
+  uint dev;
+  uint dir;              // inum of the directory; 0 if unused
+  char name[DIRSIZ];
+  uint inum;             // inum name refers to; 0 if none
+  int used;              // looked up since last moved in the LRU list?
+  struct dentry *hnext;  // hash chain
+  struct dentry *prev;   // LRU list
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *hash[NDHASH];
+  uint seq[NDHASH];      // sequence count of each hash chain
+
+  // Linked list of all entries, through prev/next.
+  // Sorted by how recently the entry was used.
+  // head.next is most recent, head.prev is least.
+  struct dentry head;
+} dcache;
+
+void
+dcinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.next = &dcache.head;
+  for(d = dcache.dentry; d < dcache.dentry+NDENTRY; d++){
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+  }
+}
+
+static uint
+dchash(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// Find the entry for name in directory dir.
+// Caller must hold dcache.lock.
+static struct dentry*
+dcfind(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dchash(dev, dir, name)]; d; d = d->hnext){
+    if(d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0)
+      return d;
+  }
+  return 0;
+}
+
+// Move d to the head of the most-recently-used list.
+// Caller must hold dcache.lock.
+static void
+dctouch(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = dcache.head.next;
+  d->prev = &dcache.head;
+  dcache.head.next->prev = d;
+  dcache.head.next = d;
+}
+
+// Start and finish a change to hash chain h.
+// Caller must hold dcache.lock.
+static void
+dcwbegin(uint h)
+{
+  dcache.seq[h]++;
+  __sync_synchronize();
+}
+
+static void
+dcwend(uint h)
+{
+  __sync_synchronize();
+  dcache.seq[h]++;
+}
+
+// Remove d from its hash chain and mark it unused.
+// Caller must hold dcache.lock.
+static void
+dcunhash(struct dentry *d)
+{
+  struct dentry **pp;
+  uint h;
+
+  if(d->dir == 0)
+    return;
+  h = dchash(d->dev, d->dir, d->name);
+  dcwbegin(h);
+  for(pp = &dcache.hash[h]; *pp != d; pp = &(*pp)->hnext)
+    ;
+  *pp = d->hnext;
+  d->dir = 0;
+  dcwend(h);
+}
+
+// Look up name without dcache.lock.
+// Returns 1 and sets *ipp as dclookup() does, 0 if the name
+// is not cached, or -1 if a concurrent change interfered.
+static int
+dclookup_nolock(uint dev, uint dir, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+  uint h, seq, inum;
+  int n, found;
+
+  h = dchash(dev, dir, name);
+  seq = __atomic_load_n(&dcache.seq[h], __ATOMIC_SEQ_CST);
+  if(seq & 1)
+    return -1;
+
+  // An entry can move to another chain under us, so bound
+  // the walk; the sequence check below catches the move.
+  found = 0;
+  inum = 0;
+  for(d = dcache.hash[h], n = 0; d && n < NDENTRY; d = d->hnext, n++){
+    if(d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0){
+      inum = d->inum;
+      d->used = 1;
+      found = 1;
+      break;
+    }
+  }
+  __sync_synchronize();
+  if(dcache.seq[h] != seq)
+    return -1;
+  if(!found)
+    return 0;
+
+  *ipp = inum ? iget(dev, inum) : 0;
+  __sync_synchronize();
+  if(dcache.seq[h] != seq){
+    if(*ipp)
+      iput(*ipp);
+    return -1;
+  }
+  return 1;
+}
+
+// Look up name in directory dp, which need not be locked.
+// If the cache knows the answer, return 1 and set *ipp to
+// the referenced inode, or to 0 if there is no such name.
+// Otherwise return 0.
+int
+dclookup(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+  int r;
+
+  if((r = dclookup_nolock(dp->dev, dp->inum, name, ipp)) >= 0)
+    return r;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  dctouch(d);
+  // Take the reference before releasing the lock, so that the
+  // inode cannot be unlinked and freed in between.
+  *ipp = d->inum ? iget(d->dev, d->inum) : 0;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp refers to inode inum,
+// or to nothing if inum is 0.
+// Caller must hold dp->lock.
+void
+dcenter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d;
+  uint h;
+
+  if(!holdingsleep(&dp->lock) || dp->type != T_DIR)
+    panic("dcenter");
+
+  acquire(&dcache.lock);
+  h = dchash(dp->dev, dp->inum, name);
+  if((d = dcfind(dp->dev, dp->inum, name)) == 0){
+    // Recycle the least recently used entry, giving entries
+    // found by lock-free lookups a second chance.
+    while((d = dcache.head.prev)->used){
+      d->used = 0;
+      dctouch(d);
+    }
+    dcunhash(d);
+    dcwbegin(h);
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    d->inum = inum;
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+    dcwend(h);
+  } else if(d->inum != inum){
+    dcwbegin(h);
+    d->inum = inum;
+    dcwend(h);
+  }
+  dctouch(d);
+  release(&dcache.lock);
+}
+
+// Forget all entries for directory dir, whose inode is
+// being freed.
+void
+dcpurge(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry+NDENTRY; d++){
+    if(d->dev == dev && d->dir == dir)
+      dcunhash(d);
+  }
+  release(&dcache.lock);
+}
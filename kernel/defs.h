@@ -2,12 +2,14 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct logstat;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
 
 // bio.c
 void            binit(void);
@@ -16,12 +18,21 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bsetsize(uint, uint);
+void            breserve(int);
+uint            bsize(uint);
 
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcinit(void);
+int             dclookup(struct inode*, char*, struct inode**);
+void            dcenter(struct inode*, char*, uint);
+void            dcpurge(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -30,16 +41,21 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
-int             fileread(struct file*, uint64, int n);
+int             fileread(struct file*, int, uint64, int n);
 int             filestat(struct file*, uint64 addr);
-int             filewrite(struct file*, uint64, int n);
+int             filewrite(struct file*, int, uint64, int n);
+int             filesplice(struct file*, struct file*, int n);
+int             filesync(struct file*, int);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+void            dirunlink(struct inode*, char*, uint);
+int             isdirempty(struct inode*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -50,9 +66,16 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readstream(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             ifalloc(struct inode*, uint, uint, int);
+uint            maxfilesize(uint);
+int             ipunch(struct inode*, uint, uint);
+int             icopy(struct inode*, uint, struct inode*, uint, uint);
+int             iwritecost(struct inode*);
 void            itrunc(struct inode*);
+void            ireclaim(uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -67,14 +90,22 @@ void            kinit(void);
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_data(struct buf*);
+void            log_free(uint);
+void            log_reclaim(void);
 void            begin_op(void);
 void            end_op(void);
+int             begin_opn(int);
+void            end_opn(int);
+uint            log_txn(void);
+void            log_sync(uint);
+void            logstat(struct logstat*);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -97,13 +128,19 @@ void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
+int             sleeptimeout(void*, struct spinlock*, uint64);
 void            userinit(void);
+int             kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeupone(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             cpustat(uint64, int);
+int             setpriority(int, int);
+uint64          cputime(void);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -139,6 +176,14 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timersinit(void);
+uint64          nsnow(void);
+void            timeradd(struct timer*, void*, uint64);
+int             timerdel(struct timer*);
+void            clockarm(void);
+int             clockintr(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -182,5 +227,10 @@ void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
 void            virtio_disk_intr(void);
 
+// zcache.c
+void            zinit(void);
+int             zread(struct inode*, int, uint64, uint, uint);
+void            zpurge(uint, uint);
+
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -102,9 +102,10 @@ filestat(struct file *f, uint64 addr)
 }
 
 // Read from file f.
-// addr is a user virtual address.
+// If user_dst==1, then addr is a user virtual address;
+// otherwise, addr is a kernel address.
 int
-fileread(struct file *f, uint64 addr, int n)
+fileread(struct file *f, int user_dst, uint64 addr, int n)
 {
   int r = 0;
 
@@ -112,14 +113,14 @@ fileread(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, user_dst, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    r = devsw[f->major].read(user_dst, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, user_dst, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
   } else {
@@ -130,9 +131,10 @@ fileread(struct file *f, uint64 addr, int n)
 }
 
 // Write to file f.
-// addr is a user virtual address.
+// If user_src==1, then addr is a user virtual address;
+// otherwise, addr is a kernel address.
 int
-filewrite(struct file *f, uint64 addr, int n)
+filewrite(struct file *f, int user_src, uint64 addr, int n)
 {
   int r, ret = 0;
 
@@ -140,31 +142,40 @@ filewrite(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user_src, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // reserve log space for each piece of the write in
+    // proportion to its size: at worst, each data block
+    // also dirties the blocks iwritecost() counts; plus
+    // the i-node, the indirect block and 2 blocks of slop
+    // for non-aligned writes. the log may hold less than
+    // the whole write, so go a piece at a time.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int bs = bsize(f->ip->dev);
     int i = 0;
     while(i < n){
       int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
+      int per = iwritecost(f->ip);  // a guess, checked below
+      int nb = (f->off % bs + n1 + bs - 1) / bs;
+      int res = per * nb + 4;
+      if(res < MAXOPBLOCKS)
+        res = MAXOPBLOCKS;
+      res = begin_opn(res);
 
-      begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      per = iwritecost(f->ip);
+      int max = (res - 4) / per * bs - f->off % bs;
+      if(n1 > max)
+        n1 = max;
+      if ((r = writei(f->ip, user_src, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(res);
 
       if(r != n1){
         // error from writei
@@ -180,3 +191,62 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Move up to n bytes from file in to file out through a kernel
+// page, so the data never passes through user space. Either file
+// may be a pipe, an inode or a device. Like read(), returns after
+// a short read from in, so a pipe or the console is moved as soon
+// as data arrives. Returns the number of bytes moved.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  int r, w, m, tot;
+  char *pg;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if((pg = kalloc()) == 0)
+    return -1;
+
+  r = 0;
+  for(tot = 0; tot < n; tot += r){
+    m = n - tot;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    r = fileread(in, 0, (uint64)pg, m);
+    if(r <= 0)
+      break;
+    if((w = filewrite(out, 0, (uint64)pg, r)) != r){
+      if(w > 0)
+        tot += w;
+      break;
+    }
+    if(r < m){
+      tot += r;
+      break;
+    }
+  }
+  kfree(pg);
+
+  if(r < 0 && tot == 0)
+    return -1;
+  return tot;
+}
+
+// Wait until the updates to file f are on disk: all of
+// them, or if datasync, those to its data and size.
+// A full sync also first frees any orphaned inodes.
+int
+filesync(struct file *f, int datasync)
+{
+  uint txn;
+
+  if(f->type != FD_INODE)
+    return -1;
+  if(!datasync)
+    ireclaim(f->ip->dev);
+  ilock(f->ip);
+  txn = datasync ? f->ip->dtxn : f->ip->txn;
+  iunlock(f->ip);
+  log_sync(txn);
+  return 0;
+}
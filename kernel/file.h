@@ -18,6 +18,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable hash chain
+  struct inode *lprev; // itable LRU list of unreferenced inodes
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +29,11 @@ struct inode {
   short minor;
   short nlink;
   uint size;
+  uint flags;
   uint addrs[NDIRECT+1];
+
+  uint txn;           // log transaction of the last update
+  uint dtxn;          // ... of the last update to the data
 };
 
 // map major device number to device functions.
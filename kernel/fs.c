@@ -32,17 +32,34 @@ readsb(int dev, struct superblock *sb)
 {
   struct buf *bp;
 
-  bp = bread(dev, 1);
+  // The buffer cache starts out with BSIZE blocks.
+  bp = bread(dev, SBOFF / BSIZE);
   memmove(sb, bp->data, sizeof(*sb));
   brelse(bp);
 }
 
+// Write the super block, as changed by the current FS operation.
+static void
+writesb(int dev)
+{
+  struct buf *bp;
+
+  bp = bread(dev, SBOFF / sb.bsize);
+  memmove(bp->data + SBOFF % sb.bsize, &sb, sizeof(sb));
+  log_write(bp);
+  brelse(bp);
+}
+
 // Init fs
 void
 fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.bsize != BSIZE && sb.bsize != MAXBSIZE)
+    panic("fsinit: block size");
+  bsetsize(dev, sb.bsize);
+  breserve(NBUF + sb.nlog);
   initlog(dev, &sb);
 }
 
@@ -53,53 +70,283 @@ bzero(int dev, int bno)
   struct buf *bp;
 
   bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  memset(bp->data, 0, sb.bsize);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// balloc() searches the free map starting at bhint, just past
+// the block it last allocated, so that a file written
+// sequentially gets consecutive blocks and a large, mostly full
+// file system is not rescanned from the start for every block.
 
-// Allocate a zeroed disk block.
+struct {
+  struct spinlock lock;
+  uint hint;
+} bhint;
+
+// Hashes of recently written blocks, for bdedup().
+struct dedup {
+  uint dev;
+  uint hash;
+  uint blockno;          // 0 if unused
+};
+
+struct {
+  struct spinlock lock;
+  struct dedup e[NDEDUP];
+} dtab;
+
+// Search the free map for a clear bit between blocks lo and hi,
+// set it, and return its block number, or 0 if there is none.
 static uint
-balloc(uint dev)
+bmapscan(uint dev, uint lo, uint hi)
 {
-  int b, bi, m;
+  uint b, bi, m;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  for(b = lo; b < hi; ){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+    for(; b < hi && BBLOCK(b, sb) == bp->blockno; b++){
+      bi = b % BPB(sb);
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+        b += 7;  // skip a full byte of allocated blocks
+        continue;
+      }
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        return b;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  return 0;
+}
+
+// Allocate a disk block, leaving its contents as they are.
+static uint
+bnew(uint dev)
+{
+  uint start, b;
+
+  acquire(&bhint.lock);
+  start = bhint.hint;
+  release(&bhint.lock);
+  if(start >= sb.size)
+    start = 0;
+
+  // Block 0 is the boot block, never free, so 0 means none.
+  if((b = bmapscan(dev, start, sb.size)) == 0 &&
+     (b = bmapscan(dev, 0, start)) == 0)
+    panic("balloc: out of blocks");
+
+  acquire(&bhint.lock);
+  bhint.hint = b + 1;
+  release(&bhint.lock);
+  return b;
+}
+
+// Allocate a zeroed disk block.
+static uint
+balloc(uint dev)
+{
+  uint b;
+
+  b = bnew(dev);
+  bzero(dev, b);
+  return b;
 }
 
-// Free a disk block.
+// Finish writing bp, a data block of inode ip: in place if the
+// file system is FS_ORDERED and ip is a regular file, otherwise
+// through the log.
 static void
-bfree(int dev, uint b)
+dwrite(struct inode *ip, struct buf *bp)
+{
+  if((sb.flags & FS_ORDERED) && ip->type == T_FILE)
+    log_data(bp);
+  else
+    log_write(bp);
+}
+
+// Allocate a zeroed data block for inode ip.
+static uint
+dalloc(struct inode *ip)
 {
   struct buf *bp;
-  int bi, m;
+  uint b;
 
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
-  bp->data[bi/8] &= ~m;
+  b = bnew(ip->dev);
+  bp = bread(ip->dev, b);
+  memset(bp->data, 0, sb.bsize);
+  dwrite(ip, bp);
+  brelse(bp);
+  return b;
+}
+
+// Return the number of references to block b beyond the first.
+static int
+brefs(uint dev, uint b)
+{
+  struct buf *bp;
+  int n;
+
+  bp = bread(dev, RBLOCK(b, sb));
+  n = bp->data[b % sb.bsize];
+  brelse(bp);
+  return n;
+}
+
+// Add a reference to block b, so that another file can share it.
+// Returns -1 if b already has the maximum number of references.
+static int
+bshare(uint dev, uint b)
+{
+  struct buf *bp;
+  uchar *r;
+
+  bp = bread(dev, RBLOCK(b, sb));
+  r = &bp->data[b % sb.bsize];
+  if(*r == MAXREF){
+    brelse(bp);
+    return -1;
+  }
+  (*r)++;
   log_write(bp);
   brelse(bp);
+  return 0;
+}
+
+// Forget the dtab entries (see bdedup) of the n freed blocks
+// in v, which is sorted in decreasing order.
+static void
+dtabdrop(int dev, uint *v, int n)
+{
+  struct dedup *d;
+  int lo, hi, mid;
+
+  acquire(&dtab.lock);
+  for(d = dtab.e; d < dtab.e+NDEDUP; d++){
+    if(d->blockno == 0 || d->dev != dev ||
+       d->blockno > v[0] || d->blockno < v[n-1])
+      continue;
+    lo = 0;
+    hi = n;
+    while(lo < hi){
+      mid = (lo + hi) / 2;
+      if(v[mid] > d->blockno)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if(lo < n && v[lo] == d->blockno)
+      d->blockno = 0;
+  }
+  release(&dtab.lock);
+}
+
+// Drop a reference to each of the n blocks in v, as bfree()
+// does, but read and write each free map and reference count
+// block only once. Overwrites v.
+static void
+bfreev(int dev, uint *v, int n)
+{
+  struct buf *bp;
+  int i, j, bi, m, nfree, dirty;
+  uint b;
+
+  // Insertion sort, in decreasing order: blocks collected
+  // from the end of a file usually arrive nearly so.
+  for(i = 1; i < n; i++){
+    b = v[i];
+    for(j = i; j > 0 && v[j-1] < b; j--)
+      v[j] = v[j-1];
+    v[j] = b;
+  }
+
+  // First drop the extra references, moving the blocks that
+  // had none to the front of v, then clear those in the free
+  // map. Holding only one kind of buffer at a time keeps two
+  // concurrent frees from locking them in opposite orders.
+  bp = 0;
+  dirty = 0;
+  nfree = 0;
+  for(i = 0; i < n; i++){
+    b = v[i];
+    if(bp == 0 || bp->blockno != RBLOCK(b, sb)){
+      if(bp){
+        if(dirty)
+          log_write(bp);
+        brelse(bp);
+      }
+      bp = bread(dev, RBLOCK(b, sb));
+      dirty = 0;
+    }
+    if(bp->data[b % sb.bsize] > 0){
+      bp->data[b % sb.bsize]--;
+      dirty = 1;
+      // Another file may now write b in place.
+      log_free(b);
+    } else
+      v[nfree++] = b;
+  }
+  if(bp){
+    if(dirty)
+      log_write(bp);
+    brelse(bp);
+  }
+
+  bp = 0;
+  for(i = 0; i < nfree; i++){
+    b = v[i];
+    if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+      if(bp){
+        log_write(bp);
+        brelse(bp);
+      }
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    bi = b % BPB(sb);
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0)
+      panic("freeing free block");
+    bp->data[bi/8] &= ~m;
+    log_free(b);
+  }
+  if(bp){
+    log_write(bp);
+    brelse(bp);
+  }
+
+  if(nfree > 0 && (sb.flags & FS_DEDUP))
+    dtabdrop(dev, v, nfree);
+}
+
+// Drop a reference to a disk block, freeing it if it was the last.
+static void
+bfree(int dev, uint b)
+{
+  bfreev(dev, &b, 1);
+}
+
+// Note that block b will be written by the current operation.
+// Returns the number of blocks in the set so far, counting b
+// only if it was not already there.
+static int
+optouch(uint *set, int n, uint b)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(set[i] == b)
+      return n;
+  set[n] = b;
+  return n+1;
 }
 
 // Inodes.
@@ -124,21 +371,28 @@ bfree(int dev, uint b)
 // rest of the file system code.
 //
 // * Allocation: an inode is allocated if its type (on disk)
-//   is non-zero. ialloc() allocates, and iput() frees if
-//   the reference and link counts have fallen to zero.
+//   is non-zero and its bit in the inode map is set. ialloc()
+//   allocates, and iput() frees if the reference and link
+//   counts have fallen to zero.
 //
 // * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   is unreferenced if ip->ref is zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
 //   decrements ref.
 //
+// * Cached: an unreferenced entry stays in the table, still
+//   valid, on a least-recently-used list. A later iget() of the
+//   same inode finds it without reading the disk. iget() recycles
+//   the least recently used unreferenced entry only when it needs
+//   a slot for a different inode.
+//
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,32 +416,154 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table keyed by (dev, inum). Each bucket's
+// spin-lock protects its chain and the ref of every entry on
+// it; since ip->dev and ip->inum say which bucket an entry is
+// in, they change only while the entry is off every chain.
+// The itable.lock spin-lock protects the LRU list, the list of
+// never-used entries, and moving entries between buckets. It
+// must be acquired before any bucket lock. The table starts with
+// NINODE entries and grows a page at a time when every entry is
+// referenced; iput() frees such a page again once none of its
+// entries is referenced. An entry is on the LRU list whenever it
+// is unreferenced and holds an inode, and on the free list, with
+// inum 0, when it holds none.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;
+};
+
 struct {
   struct spinlock lock;
+  struct inode lru;    // unreferenced entries, most recently used first
+  struct inode *free;  // entries that have never held an inode
+  struct ibucket bucket[NIHASH];
   struct inode inode[NINODE];
 } itable;
 
+// The inode map has one bit per inode, set if the inode is
+// allocated. ialloc() starts its search at ihint, the inode
+// after the one most recently allocated, or the lowest inode
+// freed since; ifree() moves the hint back down.
+struct {
+  struct spinlock lock;
+  uint hint;
+} ihint;
+
+// orphans.lock serializes changes to the orphan list, that is,
+// to sb.orphan and to the next fields of the orphans' dinodes.
+// It is acquired after any inode's lock.
+// orphans.reclaim lets only one ireclaim() run at a time, so
+// that two do not both free the orphan at the head of the list.
+// It is acquired before begin_op().
+struct {
+  struct sleeplock lock;
+  struct sleeplock reclaim;
+} orphans;
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&itable.lock, "itable");
+  initlock(&ihint.lock, "ihint");
+  initlock(&bhint.lock, "bhint");
+  initlock(&dtab.lock, "dtab");
+  initsleeplock(&orphans.lock, "orphans");
+  initsleeplock(&orphans.reclaim, "reclaim");
+  ihint.hint = 1;
+  itable.lru.lnext = &itable.lru;
+  itable.lru.lprev = &itable.lru;
+  for(i = 0; i < NIHASH; i++)
+    initlock(&itable.bucket[i].lock, "itable.bucket");
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
+    itable.inode[i].next = itable.free;
+    itable.free = &itable.inode[i];
+  }
+}
+
+// Search the inode map for a clear bit between inodes lo and hi,
+// set it, and return its inode number, or 0 if there is none.
+static uint
+imapscan(uint dev, uint lo, uint hi)
+{
+  uint inum, bi, m;
+  struct buf *bp;
+
+  for(inum = lo; inum < hi; ){
+    bp = bread(dev, IMBLOCK(inum, sb));
+    for(; inum < hi && IMBLOCK(inum, sb) == bp->blockno; inum++){
+      bi = inum % BPB(sb);
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+        inum += 7;  // skip a full byte of allocated inodes
+        continue;
+      }
+      m = 1 << (bi % 8);
+      if((bp->data[bi/8] & m) == 0){  // Is inode free?
+        bp->data[bi/8] |= m;  // Mark inode in use.
+        log_write(bp);
+        brelse(bp);
+        return inum;
+      }
+    }
+    brelse(bp);
   }
+  return 0;
+}
+
+// Allocate an inode number in the inode map.
+static uint
+imapalloc(uint dev)
+{
+  uint start, inum;
+
+  acquire(&ihint.lock);
+  start = ihint.hint;
+  release(&ihint.lock);
+  if(start < 1 || start >= sb.ninodes)
+    start = 1;
+
+  if((inum = imapscan(dev, start, sb.ninodes)) == 0 &&
+     (inum = imapscan(dev, 1, start)) == 0)
+    return 0;
+
+  acquire(&ihint.lock);
+  ihint.hint = inum + 1;
+  release(&ihint.lock);
+  return inum;
 }
 
-static struct inode* iget(uint dev, uint inum);
+// Free an inode number in the inode map.
+static void
+ifree(uint dev, uint inum)
+{
+  struct buf *bp;
+  int bi, m;
+
+  bp = bread(dev, IMBLOCK(inum, sb));
+  bi = inum % BPB(sb);
+  m = 1 << (bi % 8);
+  if((bp->data[bi/8] & m) == 0)
+    panic("freeing free inode");
+  bp->data[bi/8] &= ~m;
+  log_write(bp);
+  brelse(bp);
+
+  acquire(&ihint.lock);
+  if(inum < ihint.hint)
+    ihint.hint = inum;
+  release(&ihint.lock);
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -195,23 +571,84 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
+  if((inum = imapalloc(dev)) == 0)
+    panic("ialloc: no inodes");
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB(sb);
+  if(dip->type != 0)
+    panic("ialloc: inode map");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  if(type == T_FILE)
+    dip->flags = DI_INLINE;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
+}
+
+// The orphan list (see fs.h).
+
+// Return the dinode next field of inode inum.
+static uint
+orphannext(uint dev, uint inum)
+{
+  struct buf *bp;
+  uint next;
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  next = ((struct dinode*)bp->data + inum%IPB(sb))->next;
+  brelse(bp);
+  return next;
+}
+
+static void
+orphansetnext(uint dev, uint inum, uint next)
+{
+  struct buf *bp;
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  ((struct dinode*)bp->data + inum%IPB(sb))->next = next;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Put inode inum at the head of the orphan list.
+static void
+orphanadd(uint dev, uint inum)
+{
+  acquiresleep(&orphans.lock);
+  orphansetnext(dev, inum, sb.orphan);
+  sb.orphan = inum;
+  writesb(dev);
+  releasesleep(&orphans.lock);
+  log_reclaim();
+}
+
+// Remove inode inum from the orphan list.
+static void
+orphandel(uint dev, uint inum)
+{
+  uint prev, next;
+
+  acquiresleep(&orphans.lock);
+  next = orphannext(dev, inum);
+  if(sb.orphan == inum){
+    sb.orphan = next;
+    writesb(dev);
+  } else {
+    prev = sb.orphan;
+    while(prev != 0 && orphannext(dev, prev) != inum)
+      prev = orphannext(dev, prev);
+    if(prev == 0)
+      panic("orphandel");
+    orphansetnext(dev, prev, next);
   }
-  panic("ialloc: no inodes");
+  releasesleep(&orphans.lock);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -225,48 +662,195 @@ iupdate(struct inode *ip)
   struct dinode *dip;
 
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-  dip = (struct dinode*)bp->data + ip->inum%IPB;
+  dip = (struct dinode*)bp->data + ip->inum%IPB(sb);
+  ip->txn = log_txn();
+  if(dip->size != ip->size || dip->flags != ip->flags ||
+     memcmp(dip->addrs, ip->addrs, sizeof(ip->addrs)) != 0)
+    ip->dtxn = ip->txn;
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
+  dip->flags = ip->flags;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
+// Find the entry for inode inum on device dev in bucket b.
+// Caller must hold b->lock.
 static struct inode*
-iget(uint dev, uint inum)
+ifind(struct ibucket *b, uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
-  acquire(&itable.lock);
+  for(ip = b->head; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  }
+  return 0;
+}
 
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
+// Remove ip from the LRU list, if it is on it.
+// Caller must hold itable.lock.
+static void
+lruremove(struct inode *ip)
+{
+  if(ip->lnext == 0)
+    return;
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext = ip->lprev = 0;
+}
+
+// Add a page of never-used entries to the table.
+// Caller must hold itable.lock.
+static void
+igrow(void)
+{
+  struct inode *ip;
+  char *pg;
+
+  if((pg = kalloc()) == 0)
+    return;
+  memset(pg, 0, PGSIZE);
+  for(ip = (struct inode*)pg; ip + 1 <= (struct inode*)(pg + PGSIZE); ip++){
+    initsleeplock(&ip->lock, "inode");
+    ip->next = itable.free;
+    itable.free = ip;
+  }
+}
+
+// Is ip in a page added by igrow()?
+static int
+igrown(struct inode *ip)
+{
+  return ip < &itable.inode[0] || ip >= &itable.inode[NINODE];
+}
+
+// If no entry in ip's page, which igrow() added, is referenced,
+// take them all out of the table and free the page.
+// Caller must hold itable.lock.
+static void
+ifreepage(struct inode *ip)
+{
+  struct inode *first, *end, *e, **pp;
+  struct ibucket *b;
+
+  first = (struct inode*)PGROUNDDOWN((uint64)ip);
+  end = first + PGSIZE/sizeof(struct inode);
+
+  // A quick look without the bucket locks, as a hint.
+  for(e = first; e < end; e++)
+    if(e->ref != 0)
+      return;
+
+  // Evict the entries to the free list, stopping if iget()
+  // has revived one.
+  for(e = first; e < end; e++){
+    if(e->inum == 0)
+      continue;
+    b = &itable.bucket[IHASH(e->dev, e->inum)];
+    acquire(&b->lock);
+    if(e->ref != 0){
+      release(&b->lock);
+      return;
+    }
+    for(pp = &b->head; *pp != e; pp = &(*pp)->next)
+      ;
+    *pp = e->next;
+    release(&b->lock);
+    lruremove(e);
+    e->dev = 0;
+    e->inum = 0;
+    e->valid = 0;
+    e->next = itable.free;
+    itable.free = e;
+  }
+
+  for(pp = &itable.free; *pp; ){
+    if(*pp >= first && *pp < end)
+      *pp = (*pp)->next;
+    else
+      pp = &(*pp)->next;
+  }
+  kfree((char*)first);
+}
+
+// Find a table entry to hold a new inode: a never-used entry,
+// else the least recently used unreferenced entry, else a new
+// one. Caller must hold itable.lock and b->lock.
+static struct inode*
+irecycle(struct ibucket *b)
+{
+  struct inode *ip, **pp;
+  struct ibucket *vb;
+
+  while(itable.free == 0 && itable.lru.lprev != &itable.lru){
+    ip = itable.lru.lprev;
+    lruremove(ip);
+    // Entries stay on the list when iget() revives them,
+    // so check that this one is still unreferenced.
+    vb = &itable.bucket[IHASH(ip->dev, ip->inum)];
+    if(vb != b)
+      acquire(&vb->lock);
+    if(ip->ref == 0){
+      for(pp = &vb->head; *pp != ip; pp = &(*pp)->next)
+        ;
+      *pp = ip->next;
+      if(vb != b)
+        release(&vb->lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    if(vb != b)
+      release(&vb->lock);
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  if(itable.free == 0)
+    igrow();
+  if((ip = itable.free) == 0)
     panic("iget: no inodes");
+  itable.free = ip->next;
+  return ip;
+}
+
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+struct inode*
+iget(uint dev, uint inum)
+{
+  struct inode *ip;
+  struct ibucket *b;
+
+  b = &itable.bucket[IHASH(dev, inum)];
+
+  // Is the inode already in the table?
+  acquire(&b->lock);
+  if((ip = ifind(b, dev, inum)) != 0){
+    ip->ref++;
+    release(&b->lock);
+    return ip;
+  }
+  release(&b->lock);
 
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
+  // Recycle an inode entry, checking again in case another
+  // process added this inode while b->lock was released.
+  acquire(&itable.lock);
+  acquire(&b->lock);
+  if((ip = ifind(b, dev, inum)) != 0){
+    ip->ref++;
+  } else {
+    ip = irecycle(b);
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->next = b->head;
+    b->head = ip;
+  }
+  release(&b->lock);
   release(&itable.lock);
 
   return ip;
@@ -277,9 +861,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = &itable.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&b->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&b->lock);
   return ip;
 }
 
@@ -298,14 +884,18 @@ ilock(struct inode *ip)
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode*)bp->data + ip->inum%IPB;
+    dip = (struct dinode*)bp->data + ip->inum%IPB(sb);
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
+    ip->flags = dip->flags;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    // Updates made before the inode was last evicted
+    // may not be committed yet.
+    ip->txn = ip->dtxn = log_txn();
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -323,8 +913,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry
+// moves to the front of the LRU list and can be recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -332,28 +922,68 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = &itable.bucket[IHASH(ip->dev, ip->inum)];
+  int unused;
+
+  acquire(&b->lock);
 
-  if(ip->ref == 1 && ip->valid && ip->nlink == 0){
-    // inode has no links and no other references: truncate and free.
+  if(ip->ref == 1 && ip->valid && ip->nlink == 0 &&
+     (ip->flags & DI_ORPHAN) == 0){
+    // inode has no links and no other references: free it,
+    // or, if it is large enough to have an indirect block,
+    // make it an orphan for ireclaim() to free.
 
     // ip->ref == 1 means no other process can have ip locked,
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
-
-    itrunc(ip);
-    ip->type = 0;
-    iupdate(ip);
-    ip->valid = 0;
+    release(&b->lock);
+
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
+    if(ip->flags & DI_COMPRESSED)
+      zpurge(ip->dev, ip->inum);
+    if((ip->flags & DI_INLINE) || ip->addrs[NDIRECT] == 0){
+      itrunc(ip);
+      ip->type = 0;
+      iupdate(ip);
+      ifree(ip->dev, ip->inum);
+      ip->valid = 0;
+    } else {
+      orphanadd(ip->dev, ip->inum);
+      ip->flags |= DI_ORPHAN;
+      iupdate(ip);
+    }
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&b->lock);
+  }
+
+  if(ip->ref > 1){
+    ip->ref--;
+    release(&b->lock);
+    return;
   }
+  release(&b->lock);
 
+  // Dropping what may be the last reference: hold itable.lock
+  // too, so that the entry is on the LRU list by the time
+  // ifreepage() can see it unreferenced.
+  acquire(&itable.lock);
+  acquire(&b->lock);
   ip->ref--;
+  unused = ip->ref == 0;
+  release(&b->lock);
+  if(unused){
+    lruremove(ip);
+    ip->lnext = itable.lru.lnext;
+    ip->lprev = &itable.lru;
+    itable.lru.lnext->lprev = ip;
+    itable.lru.lnext = ip;
+    if(igrown(ip))
+      ifreepage(ip);
+  }
   release(&itable.lock);
 }
 
@@ -371,30 +1001,46 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// A new file starts out with DI_INLINE set, and keeps its
+// data in ip->addrs[] itself until it grows past NINLINE
+// bytes; writei() then moves the data to a block. Small
+// files thus cost no data block and no read beyond the
+// inode's own block.
+//
+// Files may have holes: blocks that were never written, or
+// were punched out by ipunch(), have address 0 and read as
+// zeroes without any disk access.
+
+static char zeroes[MAXBSIZE];
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one if alloc is
+// set and otherwise returns 0.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int alloc)
 {
   uint addr, *a;
   struct buf *bp;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && alloc)
+      ip->addrs[bn] = addr = dalloc(ip);
     return addr;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
+  if(bn < NINDIRECT(sb)){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
+    if((addr = ip->addrs[NDIRECT]) == 0){
+      if(!alloc)
+        return 0;
       ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+    if((addr = a[bn]) == 0 && alloc){
+      a[bn] = addr = dalloc(ip);
       log_write(bp);
     }
     brelse(bp);
@@ -404,38 +1050,377 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+// Make addr the nth block of inode ip, returning the old one.
+// Caller must iupdate(ip).
+static uint
+bmapset(struct inode *ip, uint bn, uint addr)
 {
-  int i, j;
+  uint old, *a;
   struct buf *bp;
-  uint *a;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  if(bn < NDIRECT){
+    old = ip->addrs[bn];
+    ip->addrs[bn] = addr;
+    return old;
   }
+  bn -= NDIRECT;
 
-  if(ip->addrs[NDIRECT]){
+  if(ip->addrs[NDIRECT] == 0)
+    ip->addrs[NDIRECT] = balloc(ip->dev);
+  bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  a = (uint*)bp->data;
+  old = a[bn];
+  a[bn] = addr;
+  log_write(bp);
+  brelse(bp);
+  return old;
+}
+
+// Return a locked buffer holding the nth block of inode ip,
+// about to be written: allocate the block if there is none, and
+// if it is shared with other files, give ip a copy of its own.
+// On a file system with FS_DEDUP any block may be shared, since
+// bdedup() does not know which files use the blocks it shares;
+// the reference count is checked with the block locked, so that
+// bdedup() cannot share it in the meantime.
+static struct buf*
+bcow(struct inode *ip, uint bn)
+{
+  uint addr, naddr;
+  struct buf *from, *to;
+
+  addr = bmap(ip, bn, 1);
+  from = bread(ip->dev, addr);
+  if(((ip->flags & DI_SHARED) == 0 && (sb.flags & FS_DEDUP) == 0) ||
+     brefs(ip->dev, addr) == 0)
+    return from;
+  naddr = bnew(ip->dev);
+  to = bread(ip->dev, naddr);
+  memmove(to->data, from->data, sb.bsize);
+  dwrite(ip, to);
+  brelse(from);
+  bmapset(ip, bn, naddr);
+  bfree(ip->dev, addr);
+  return to;
+}
+
+// Deduplication.
+//
+// On a file system with FS_DEDUP, writei() passes each whole
+// block it writes to bdedup(), which looks the block's data up
+// in dtab, a table of the hashes of recently written blocks. If
+// an earlier block, still allocated, holds the same data, the
+// file shares it copy-on-write and the new block is freed.
+// bfreev() drops the entries of the blocks it frees, so that an
+// entry never names a block reused for something else, such as
+// an indirect block, which is written without copy-on-write.
+//
+// dtab (see above) is only a hint: bdedup() compares the data
+// before sharing a block. It holds the buffers of both blocks
+// while it does, and takes the earlier block's lock second only
+// if its number is lower, so that two bdedup()s cannot deadlock.
+
+// FNV-1a hash of a block's data, with a final mix so that
+// its low bits, which index the table, depend on all of it.
+static uint
+bhash(uchar *data)
+{
+  uint h = 2166136261U;
+  int i;
+
+  for(i = 0; i < sb.bsize; i++)
+    h = (h ^ data[i]) * 16777619U;
+  h = (h ^ (h >> 16)) * 0x85ebca6bU;
+  h = (h ^ (h >> 13)) * 0xc2b2ae35U;
+  return h ^ (h >> 16);
+}
+
+// Is block b allocated?
+static int
+bused(uint dev, uint b)
+{
+  struct buf *bp;
+  int bi, used;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB(sb);
+  used = (bp->data[bi/8] & (1 << (bi % 8))) != 0;
+  brelse(bp);
+  return used;
+}
+
+// bp holds the nth block of inode ip, which the caller has just
+// written. If it is all zero, free it, leaving a hole, as mkfs
+// does; if an earlier block holds the same data, make ip share
+// it instead; otherwise remember bp's. Releases bp.
+static void
+bdedup(struct inode *ip, uint bn, struct buf *bp)
+{
+  struct dedup *d;
+  struct buf *cp;
+  uint h, c, old;
+  int i;
+
+  // An all-zero block reads back the same as a hole.
+  for(i = 0; i < sb.bsize && bp->data[i] == 0; i++)
+    ;
+  if(i == sb.bsize){
+    brelse(bp);
+    if((old = bmapset(ip, bn, 0)) != 0)
+      bfree(ip->dev, old);
+    return;
+  }
+
+  h = bhash(bp->data);
+  d = &dtab.e[h % NDEDUP];
+  acquire(&dtab.lock);
+  c = 0;
+  if(d->blockno && d->dev == ip->dev && d->hash == h)
+    c = d->blockno;
+  if(c == 0 || c > bp->blockno){
+    d->dev = ip->dev;
+    d->hash = h;
+    d->blockno = bp->blockno;
+  }
+  release(&dtab.lock);
+  if(c == 0 || c >= bp->blockno){
+    brelse(bp);
+    return;
+  }
+
+  cp = bread(ip->dev, c);
+  if(memcmp(cp->data, bp->data, sb.bsize) != 0 ||
+     !bused(ip->dev, c) || bshare(ip->dev, c) < 0){
+    brelse(cp);
+    acquire(&dtab.lock);
+    if(d->blockno == c){
+      d->dev = ip->dev;
+      d->hash = h;
+      d->blockno = bp->blockno;
+    }
+    release(&dtab.lock);
+    brelse(bp);
+    return;
+  }
+  brelse(cp);
+  old = bp->blockno;
+  brelse(bp);
+  bmapset(ip, bn, c);
+  bfree(ip->dev, old);
+  ip->flags |= DI_SHARED;
+}
+
+// Return the most blocks that writing one block of ip's data can
+// add to an FS operation: the data block and a free map block; a
+// reference count block if the block may be shared; and with
+// FS_DEDUP, the reference count block of the block bdedup() shares.
+// (The block bdedup() frees was either just allocated, so its free
+// map block is counted, or was already there, so none was.)
+int
+iwritecost(struct inode *ip)
+{
+  int n;
+
+  n = 2;
+  if((ip->flags & DI_SHARED) || (sb.flags & FS_DEDUP))
+    n++;
+  if(sb.flags & FS_DEDUP)
+    n++;
+  return n;
+}
+
+// Free the nth block of inode ip, if it has one.
+static void
+bunmap(struct inode *ip, uint bn)
+{
+  uint *a;
+  struct buf *bp;
+
+  if(bn < NDIRECT){
+    if(ip->addrs[bn]){
+      bfree(ip->dev, ip->addrs[bn]);
+      ip->addrs[bn] = 0;
+    }
+    return;
+  }
+  bn -= NDIRECT;
+
+  if(ip->addrs[NDIRECT] == 0)
+    return;
+  bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  a = (uint*)bp->data;
+  if(a[bn]){
+    bfree(ip->dev, a[bn]);
+    a[bn] = 0;
+    log_write(bp);
+  }
+  brelse(bp);
+}
+
+// Most blocks ishrink() frees in one call, so that it needs
+// no more than a small array on the stack.
+#define NSHRINK 64
+
+// Add block b to the n blocks in v that ishrink() will free,
+// unless that might make the FS operation write more than limit
+// free map and reference count blocks (if limit > 0), as
+// counted in set. Returns 1 if b was added.
+static int
+shrinkadd(uint *v, int *n, uint *set, int *nset, int limit, uint b)
+{
+  int ns;
+
+  if(*n == NSHRINK)
+    return 0;
+  if(limit > 0){
+    ns = optouch(set, *nset, RBLOCK(b, sb));
+    ns = optouch(set, ns, BBLOCK(b, sb));
+    if(ns > limit)
+      return 0;
+    *nset = ns;
+  }
+  v[(*n)++] = b;
+  return 1;
+}
+
+// Free ip's blocks from the end, last first, until none are left
+// or NSHRINK of them have been collected or, if limit > 0, freeing
+// another might write more than limit free map and reference
+// count blocks. Returns 1 if ip has no blocks left.
+// Caller must hold ip->lock.
+static int
+ishrink(struct inode *ip, int limit)
+{
+  int i, j, n, nset, dirty, done;
+  uint *a, v[NSHRINK], set[MAXOPBLOCKS+2];
+  struct buf *bp;
+
+  n = nset = 0;
+  done = 0;
+
+  if(ip->addrs[NDIRECT]){
     bp = bread(ip->dev, ip->addrs[NDIRECT]);
     a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    dirty = 0;
+    for(j = NINDIRECT(sb); j > 0; j--){
+      if(a[j-1] == 0)
+        continue;
+      if(!shrinkadd(v, &n, set, &nset, limit, a[j-1]))
+        break;
+      a[j-1] = 0;
+      dirty = 1;
     }
+    if(j == 0 && shrinkadd(v, &n, set, &nset, limit, ip->addrs[NDIRECT]))
+      ip->addrs[NDIRECT] = 0;
+    else if(dirty)
+      log_write(bp);
+    brelse(bp);
+    if(ip->addrs[NDIRECT])
+      goto out;
+  }
+
+  for(i = NDIRECT; i > 0; i--){
+    if(ip->addrs[i-1] == 0)
+      continue;
+    if(!shrinkadd(v, &n, set, &nset, limit, ip->addrs[i-1]))
+      break;
+    ip->addrs[i-1] = 0;
+  }
+  done = (i == 0);
+
+out:
+  bfreev(ip->dev, v, n);
+  iupdate(ip);
+  return done;
+}
+
+// Truncate inode (discard contents).
+// A file with an indirect block instead gives its blocks to a
+// new orphan inode, so that they are freed in the background
+// rather than all within the caller's FS operation.
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum;
+
+  if(ip->flags & DI_INLINE){
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+
+  if(ip->addrs[NDIRECT] && (inum = imapalloc(ip->dev)) != 0){
+    bp = bread(ip->dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB(sb);
+    if(dip->type != 0)
+      panic("itrunc: inode map");
+    memset(dip, 0, sizeof(*dip));
+    dip->type = ip->type;
+    dip->size = ip->size;
+    dip->flags = (ip->flags & DI_SHARED) | DI_ORPHAN;
+    memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+    log_write(bp);
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    orphanadd(ip->dev, inum);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+  } else {
+    while(!ishrink(ip, 0))
+      ;
   }
 
+  ip->flags &= ~(DI_SHARED|DI_COMPRESSED);
+  if(ip->type == T_FILE)
+    ip->flags |= DI_INLINE;
   ip->size = 0;
   iupdate(ip);
 }
 
+// Free the orphans: their blocks, a few at a time so that each
+// FS operation stays small, and then the inodes themselves.
+// The writeback thread calls this, so that unlink() and
+// truncation return without waiting, and so that orphans left
+// by a crash are freed after the next boot; so does fsync(),
+// so that space freed before it is free when it returns.
+// Must not be called inside begin_op()/end_op().
+void
+ireclaim(uint dev)
+{
+  struct inode *ip;
+  uint inum;
+
+  acquiresleep(&orphans.reclaim);
+  // Looking at sb.orphan without the lock is only a hint.
+  while(sb.orphan != 0){
+    begin_op();
+    acquiresleep(&orphans.lock);
+    inum = sb.orphan;
+    releasesleep(&orphans.lock);
+    if(inum == 0){
+      end_op();
+      break;
+    }
+    ip = iget(dev, inum);
+    ilock(ip);
+    // Leave room for the inode, its indirect block,
+    // the orphan list link and the inode map.
+    if(ishrink(ip, MAXOPBLOCKS-4)){
+      orphandel(dev, inum);
+      ip->type = 0;
+      ip->flags = 0;
+      iupdate(ip);
+      ifree(dev, inum);
+      ip->valid = 0;
+    }
+    iunlockput(ip);
+    end_op();
+  }
+  releasesleep(&orphans.reclaim);
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -448,6 +1433,34 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Copy n bytes at offset off in the data blocks of ip to dst.
+static int
+readblocks(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m, addr;
+  struct buf *bp;
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, sb.bsize - off%sb.bsize);
+    if((addr = bmap(ip, off/sb.bsize, 0)) == 0){
+      // A hole.
+      if(either_copyout(user_dst, dst, zeroes, m) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    bp = bread(ip->dev, addr);
+    if(either_copyout(user_dst, dst, bp->data + (off % sb.bsize), m) == -1) {
+      brelse(bp);
+      tot = -1;
+      break;
+    }
+    brelse(bp);
+  }
+  return tot;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -455,31 +1468,56 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
-
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
-      tot = -1;
-      break;
-    }
+  if(ip->flags & DI_INLINE){
+    if(either_copyout(user_dst, dst, (char*)ip->addrs + off, n) == -1)
+      return -1;
+    return n;
+  }
+  if(ip->flags & DI_COMPRESSED)
+    return zread(ip, user_dst, dst, off, n);
+  return readblocks(ip, user_dst, dst, off, n);
+}
+
+// Read n bytes at offset off of the stream of compressed
+// file ip (see fs.h) into dst, a kernel address.
+// Caller must hold ip->lock.
+int
+readstream(struct inode *ip, char *dst, uint off, uint n)
+{
+  if(off + n < off || off + n > MAXFILE(sb)*sb.bsize)
+    return -1;
+  return readblocks(ip, 0, (uint64)dst, off, n);
+}
+
+// Move the inline data of ip out to its first data block.
+static void
+iuninline(struct inode *ip)
+{
+  char data[NINLINE];
+  struct buf *bp;
+
+  memmove(data, ip->addrs, NINLINE);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->flags &= ~DI_INLINE;
+  if(ip->size > 0){
+    bp = bread(ip->dev, bmap(ip, 0, 1));
+    memmove(bp->data, data, ip->size);
+    dwrite(ip, bp);
     brelse(bp);
   }
-  return tot;
 }
 
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
+// Writing past the end of the file leaves a hole
+// between the old end and off.
 // Returns the number of bytes successfully written.
 // If the return value is less than the requested n,
 // there was an error of some kind.
@@ -489,20 +1527,37 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   uint tot, m;
   struct buf *bp;
 
-  if(off > ip->size || off + n < off)
+  if(off + n < off)
+    return -1;
+  if(off + n > MAXFILE(sb)*sb.bsize)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(ip->flags & DI_COMPRESSED)
     return -1;
 
+  if(ip->flags & DI_INLINE){
+    if(off + n <= NINLINE){
+      if(either_copyin((char*)ip->addrs + off, user_src, src, n) == -1)
+        return -1;
+      if(off + n > ip->size)
+        ip->size = off + n;
+      iupdate(ip);
+      return n;
+    }
+    iuninline(ip);
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+    bp = bcow(ip, off/sb.bsize);
+    m = min(n - tot, sb.bsize - off%sb.bsize);
+    if(either_copyin(bp->data + (off % sb.bsize), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
-    brelse(bp);
+    dwrite(ip, bp);
+    if(m == sb.bsize && (sb.flags & FS_DEDUP))
+      bdedup(ip, off/sb.bsize, bp);
+    else
+      brelse(bp);
   }
 
   if(off > ip->size)
@@ -512,11 +1567,182 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   // because the loop above might have called bmap() and added a new
   // block to ip->addrs[].
   iupdate(ip);
+  ip->dtxn = ip->txn;
 
   return tot;
 }
 
+// Return the largest possible size of a file on dev.
+uint
+maxfilesize(uint dev)
+{
+  return MAXFILE(sb)*sb.bsize;
+}
+
+// Allocate blocks for bytes [off, off+n) of inode ip, which read
+// as zeroes until written, and extend the file to off+n unless
+// keepsize is set. Returns 0, or -1 if the range is too large.
+// Caller must hold ip->lock.
+int
+ifalloc(struct inode *ip, uint off, uint n, int keepsize)
+{
+  uint bn;
+
+  if(off + n < off || off + n > MAXFILE(sb)*sb.bsize)
+    return -1;
+  if(ip->flags & DI_COMPRESSED)
+    return -1;
+  if(n == 0)
+    return 0;
+
+  if(ip->flags & DI_INLINE){
+    if(off + n > NINLINE)
+      iuninline(ip);
+  }
+  if((ip->flags & DI_INLINE) == 0){
+    for(bn = off/sb.bsize; bn <= (off+n-1)/sb.bsize; bn++)
+      bmap(ip, bn, 1);
+  }
+  if(!keepsize && off + n > ip->size)
+    ip->size = off + n;
+  iupdate(ip);
+  return 0;
+}
+
+// Punch a hole in inode ip over bytes [off, off+n): free the
+// blocks entirely inside the range and zero the parts of the
+// blocks at its ends. The file's size does not change.
+// Caller must hold ip->lock.
+int
+ipunch(struct inode *ip, uint off, uint n)
+{
+  uint end, m;
+  struct buf *bp;
+
+  if(off + n < off || (ip->flags & DI_COMPRESSED))
+    return -1;
+  end = min(off + n, MAXFILE(sb)*sb.bsize);
+
+  if(ip->flags & DI_INLINE){
+    if(off < NINLINE)
+      memset((char*)ip->addrs + off, 0, min(end, NINLINE) - off);
+    iupdate(ip);
+    return 0;
+  }
+
+  for(; off < end; off += m){
+    m = min(end - off, sb.bsize - off%sb.bsize);
+    if(m == sb.bsize){
+      bunmap(ip, off/sb.bsize);
+    } else if(bmap(ip, off/sb.bsize, 0) != 0){
+      bp = bcow(ip, off/sb.bsize);
+      memset(bp->data + off%sb.bsize, 0, m);
+      log_write(bp);
+      brelse(bp);
+    }
+  }
+  iupdate(ip);
+  ip->dtxn = ip->txn;
+  return 0;
+}
+
+// Copy n bytes at offset soff of file src to offset doff of
+// file dst. Whole blocks at block-aligned offsets are not copied
+// but shared, copy-on-write; anything else is copied through a
+// kernel page. Stops at the end of src, or early once the blocks
+// written would no longer fit in one FS operation.
+// Returns the number of bytes copied, or -1.
+// Caller must hold both inodes' locks, and src != dst.
+int
+icopy(struct inode *dst, uint doff, struct inode *src, uint soff, uint n)
+{
+  uint tot, m, saddr, daddr, bn;
+  uint set[MAXOPBLOCKS];
+  int nfixed, nset, ns;
+  char *pg;
+
+  if(soff >= src->size)
+    return 0;
+  if(n > src->size - soff)
+    n = src->size - soff;
+  if(doff + n < doff || doff + n > MAXFILE(sb)*sb.bsize)
+    return -1;
+
+  // Both inodes, dst's indirect block and a free map block
+  // for it are always counted, plus a data block and a free
+  // map block if dst's inline data must move out. Sharing a
+  // block adds the reference count and free map blocks it
+  // touches; copying one adds its data block, a free map and
+  // a reference count block, and with FS_DEDUP, one more (see
+  // iwritecost). Blocks that several shares may have in common
+  // go in set; the rest are counted in nfixed. Since nfixed is
+  // at least 4, set never holds more than MAXOPBLOCKS-1 blocks.
+  nfixed = 4;
+  if(dst->flags & DI_INLINE)
+    nfixed += 2;
+  nset = 0;
+  pg = 0;
+  for(tot = 0; tot < n; tot += m, soff += m, doff += m){
+    m = min(n - tot, sb.bsize - doff%sb.bsize);
+    if(m == sb.bsize && soff%sb.bsize == 0 &&
+       (src->flags & (DI_INLINE|DI_COMPRESSED)) == 0){
+      if(dst->flags & DI_INLINE)
+        iuninline(dst);
+      bn = doff/sb.bsize;
+      saddr = bmap(src, soff/sb.bsize, 0);
+      daddr = bmap(dst, bn, 0);
+      if(saddr == daddr)
+        continue;
+      ns = nset;
+      if(saddr)
+        ns = optouch(set, ns, RBLOCK(saddr, sb));
+      if(daddr){
+        ns = optouch(set, ns, RBLOCK(daddr, sb));
+        ns = optouch(set, ns, BBLOCK(daddr, sb));
+      }
+      if(nfixed + ns > MAXOPBLOCKS)
+        break;
+      nset = ns;
+      if(saddr == 0){
+        bunmap(dst, bn);
+        continue;
+      }
+      if(bshare(src->dev, saddr) == 0){
+        bmapset(dst, bn, saddr);
+        if(daddr)
+          bfree(dst->dev, daddr);
+        src->flags |= DI_SHARED;
+        dst->flags |= DI_SHARED;
+        continue;
+      }
+      // Too many references to share; copy it.
+    }
+    ns = (sb.flags & FS_DEDUP) ? 4 : 3;
+    if(nfixed + nset + ns > MAXOPBLOCKS)
+      break;
+    nfixed += ns;
+    if(pg == 0 && (pg = kalloc()) == 0)
+      break;
+    if(readi(src, 0, (uint64)pg, soff, m) != m ||
+       writei(dst, 0, (uint64)pg, doff, m) != m)
+      break;
+  }
+  if(pg)
+    kfree(pg);
+
+  if(doff > dst->size)
+    dst->size = doff;
+  iupdate(dst);
+  iupdate(src);
+  return tot;
+}
+
 // Directories
+//
+// A directory is either linear, an array of dirents searched
+// from the start, or hash-indexed (see fs.h). New directories are
+// linear; dirlink() converts one to indexed form when it fills its
+// first block.
 
 int
 namecmp(const char *s, const char *t)
@@ -524,17 +1750,257 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Is dp an indexed directory? If so, read its index header into *ix.
+static int
+dirindexed(struct inode *dp, struct dirindex *ix)
+{
+  if(dp->size < sb.bsize)
+    return 0;
+  if(readi(dp, 0, (uint64)ix, 0, sizeof(*ix)) != sizeof(*ix))
+    panic("dirindexed read");
+  return ix->inum == 0 && ix->magic == DIRINDEX;
+}
+
+static void
+dirwindex(struct inode *dp, struct dirindex *ix)
+{
+  if(writei(dp, 0, (uint64)ix, 0, sizeof(*ix)) != sizeof(*ix))
+    panic("dirwindex");
+}
+
+// Return the file block of the first block of bucket b.
+static uint
+dirgetmap(struct inode *dp, uint b)
+{
+  struct dirmap m;
+  uint off = (1 + b/DIRMAPN) * sizeof(m);
+
+  if(readi(dp, 0, (uint64)&m, off, sizeof(m)) != sizeof(m))
+    panic("dirgetmap");
+  return m.bucket[b % DIRMAPN];
+}
+
+static void
+dirsetmap(struct inode *dp, uint b, uint blk)
+{
+  struct dirmap m;
+  uint off = (1 + b/DIRMAPN) * sizeof(m);
+
+  if(readi(dp, 0, (uint64)&m, off, sizeof(m)) != sizeof(m))
+    panic("dirsetmap read");
+  m.bucket[b % DIRMAPN] = blk;
+  if(writei(dp, 0, (uint64)&m, off, sizeof(m)) != sizeof(m))
+    panic("dirsetmap");
+}
+
+// Read the header of bucket block blk.
+static void
+dirgetnext(struct inode *dp, uint blk, struct dirnext *nx)
+{
+  if(readi(dp, 0, (uint64)nx, blk*sb.bsize, sizeof(*nx)) != sizeof(*nx) ||
+     nx->inum != 0 || nx->magic != DIRBUCKET)
+    panic("dirgetnext");
+}
+
+// Append an empty bucket block to dp and return its file block.
+static uint
+dirnewblock(struct inode *dp)
+{
+  struct dirnext nx;
+  uint blk;
+
+  blk = dp->size / sb.bsize;
+  memset(&nx, 0, sizeof(nx));
+  nx.magic = DIRBUCKET;
+  if(writei(dp, 0, (uint64)&nx, blk*sb.bsize, sizeof(nx)) != sizeof(nx))
+    panic("dirnewblock");
+  // bmap() zeroed the rest of the block.
+  dp->size = (blk+1) * sb.bsize;
+  iupdate(dp);
+  return blk;
+}
+
+// Look for name in the bucket chain starting at file block blk.
+// Return its inum and set *poff, or return 0.
+static uint
+dirscan(struct inode *dp, uint blk, char *name, uint *poff)
+{
+  uint off;
+  struct dirnext nx;
+  struct dirent de;
+
+  for(;;){
+    dirgetnext(dp, blk, &nx);
+    for(off = blk*sb.bsize + sizeof(de); off < (blk+1)*sb.bsize; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirscan read");
+      if(de.inum != 0 && namecmp(name, de.name) == 0){
+        *poff = off;
+        return de.inum;
+      }
+    }
+    if(nx.next == 0)
+      return 0;
+    blk = nx.next;
+  }
+}
+
+// Look for name in an indexed directory.
+// Return its inum and set *poff, or return 0.
+static uint
+dirfind(struct inode *dp, struct dirindex *ix, char *name, uint *poff)
+{
+  uint b, inum;
+
+  b = dirbucket(dirhash(name), ix->nbucket);
+  if((inum = dirscan(dp, dirgetmap(dp, b), name, poff)) != 0)
+    return inum;
+  // Not yet moved out of the bucket being split?
+  if(ix->split != 0 && b == ix->nbucket - 1)
+    return dirscan(dp, ix->split, name, poff);
+  return 0;
+}
+
+// Write a dirent into the first free slot of the bucket chain
+// starting at file block blk, extending the chain if it is full.
+static void
+dirput(struct inode *dp, uint blk, struct dirent *de)
+{
+  uint off;
+  struct dirnext nx;
+  struct dirent e;
+
+  for(;;){
+    dirgetnext(dp, blk, &nx);
+    for(off = blk*sb.bsize + sizeof(e); off < (blk+1)*sb.bsize; off += sizeof(e)){
+      if(readi(dp, 0, (uint64)&e, off, sizeof(e)) != sizeof(e))
+        panic("dirput read");
+      if(e.inum == 0)
+        goto found;
+    }
+    if(nx.next == 0)
+      break;
+    blk = nx.next;
+  }
+
+  // Chain is full: link in a new block.
+  nx.next = dirnewblock(dp);
+  if(writei(dp, 0, (uint64)&nx, blk*sb.bsize, sizeof(nx)) != sizeof(nx))
+    panic("dirput link");
+  off = nx.next*sb.bsize + sizeof(e);
+
+found:
+  if(writei(dp, 0, (uint64)de, off, sizeof(*de)) != sizeof(*de))
+    panic("dirput");
+}
+
+// Split the next bucket, in linear hashing order, moving the
+// entries that now hash to the new bucket. To bound the number
+// of blocks a single dirlink() writes, each call moves the
+// entries of one block of the old bucket's chain; ix->split
+// records where the next call resumes.
+static void
+dirsplit(struct inode *dp, struct dirindex *ix)
+{
+  uint m, b, blk, off;
+  struct dirnext nx;
+  struct dirent de, zero;
+
+  if(ix->split == 0){
+    for(m = 1; m * 2 <= ix->nbucket; m *= 2)
+      ;
+    ix->split = dirgetmap(dp, ix->nbucket - m);
+    dirsetmap(dp, ix->nbucket, dirnewblock(dp));
+    ix->nbucket++;
+  }
+
+  b = ix->nbucket - 1;
+  blk = ix->split;
+  dirgetnext(dp, blk, &nx);
+  memset(&zero, 0, sizeof(zero));
+  for(off = blk*sb.bsize + sizeof(de); off < (blk+1)*sb.bsize; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirsplit read");
+    if(de.inum == 0 || dirbucket(dirhash(de.name), ix->nbucket) != b)
+      continue;
+    dirput(dp, dirgetmap(dp, b), &de);
+    if(writei(dp, 0, (uint64)&zero, off, sizeof(zero)) != sizeof(zero))
+      panic("dirsplit");
+  }
+  ix->split = nx.next;
+}
+
+// Convert a linear directory whose single block is full to
+// an indexed directory with two buckets.
+// Returns 0 on success, -1 if out of memory.
+static int
+dirconvert(struct inode *dp)
+{
+  char *old, *pg;
+  struct dirindex *ix;
+  struct dirmap *map;
+  struct dirent *de;
+
+  if((old = kalloc()) == 0)
+    return -1;
+  if((pg = kalloc()) == 0){
+    kfree(old);
+    return -1;
+  }
+  if(readi(dp, 0, (uint64)old, 0, sb.bsize) != sb.bsize)
+    panic("dirconvert read");
+
+  // Block 0 becomes the index; the buckets go in blocks 1 and 2.
+  memset(pg, 0, sb.bsize);
+  ix = (struct dirindex*)pg;
+  ix->magic = DIRINDEX;
+  ix->nbucket = 2;
+  map = (struct dirmap*)(pg + sizeof(*ix));
+  map->bucket[0] = 1;
+  map->bucket[1] = 2;
+  if(writei(dp, 0, (uint64)pg, 0, sb.bsize) != sb.bsize)
+    panic("dirconvert");
+  if(dirnewblock(dp) != 1 || dirnewblock(dp) != 2)
+    panic("dirconvert blocks");
+
+  for(de = (struct dirent*)old; de < (struct dirent*)(old + sb.bsize); de++){
+    if(de->inum == 0)
+      continue;
+    dirput(dp, map->bucket[dirbucket(dirhash(de->name), 2)], de);
+    ix->nentry++;
+  }
+  dirwindex(dp, ix);
+
+  kfree(pg);
+  kfree(old);
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Records the result in the dentry cache.
+// Caller must hold dp->lock.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct dirindex ix;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dirindexed(dp, &ix)){
+    if((inum = dirfind(dp, &ix, name, &off)) != 0){
+      if(poff)
+        *poff = off;
+      dcenter(dp, name, inum);
+      return iget(dp->dev, inum);
+    }
+    dcenter(dp, name, 0);
+    return 0;
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -545,10 +2011,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcenter(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcenter(dp, name, 0);
   return 0;
 }
 
@@ -558,6 +2026,7 @@ dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
   struct dirent de;
+  struct dirindex ix;
   struct inode *ip;
 
   // Check that name is not present.
@@ -566,22 +2035,76 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(!dirindexed(dp, &ix)){
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+
+    if(off < sb.bsize || dp->size != sb.bsize || dirconvert(dp) < 0){
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink");
+      dcenter(dp, name, inum);
+      return 0;
+    }
+    if(!dirindexed(dp, &ix))
+      panic("dirlink convert");
   }
 
+  memset(&de, 0, sizeof(de));
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+  dirput(dp, dirgetmap(dp, dirbucket(dirhash(name), ix.nbucket)), &de);
+  ix.nentry++;
+  if(ix.split != 0 ||
+     (ix.nentry > ix.nbucket * DIRSPLIT(sb) && ix.nbucket < MAXBUCKET(sb)))
+    dirsplit(dp, &ix);
+  dirwindex(dp, &ix);
+  dcenter(dp, name, inum);
 
   return 0;
 }
 
+// Remove the entry for name, found by dirlookup() at offset off,
+// from the directory dp.
+// Caller must hold dp->lock.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+  struct dirindex ix;
+
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink");
+  if(dirindexed(dp, &ix)){
+    ix.nentry--;
+    dirwindex(dp, &ix);
+  }
+  dcenter(dp, name, 0);
+}
+
+// Is the directory dp empty except for "." and ".." ?
+int
+isdirempty(struct inode *dp)
+{
+  uint off;
+  struct dirent de;
+
+  for(off = 0; off < dp->size; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("isdirempty: readi");
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
+      return 0;
+  }
+  return 1;
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -636,6 +2159,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if(!(nameiparent && *path == '\0') && dclookup(ip, name, &next)){
+      // Only directories have cached entries, so this
+      // skips both ilock(ip) and dirlookup().
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -3,11 +3,18 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#define BSIZE 1024  // default block size
+#define MAXBSIZE 4096  // largest block size
+#define SBOFF 1024  // byte offset of the super block on disk
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//      inode bit map | free bit map | reference counts | data blocks]
+//
+// The block size is 1024 or 4096 bytes, as recorded in the super
+// block. The super block always starts SBOFF bytes into the disk:
+// it is block 1 of a file system with 1024-byte blocks, and shares
+// block 0 with the boot block when blocks are 4096 bytes.
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -19,14 +26,56 @@ struct superblock {
   uint nlog;         // Number of log blocks
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
+  uint imapstart;    // Block number of first inode map block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (bytes)
+  uint refstart;     // Block number of first reference count block
+  uint orphan;       // First inode on the orphan list, or 0
+  uint flags;        // Mount options (FS_ flags)
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// super block flags
+#define FS_ORDERED 0x1  // write file data in place, not through the log
+#define FS_DEDUP   0x2  // share blocks written with the same data
+
+#define NDIRECT 11
+#define NINDIRECT(sb) ((sb).bsize / sizeof(uint))
+#define MAXFILE(sb) (NDIRECT + NINDIRECT(sb))
+
+// Files no larger than NINLINE bytes keep their data in
+// addrs[] itself rather than in data blocks.
+#define NINLINE (sizeof(uint) * (NDIRECT+1))
+
+// dinode flags
+#define DI_INLINE 0x1   // data is stored inline in addrs[]
+#define DI_SHARED 0x2   // some blocks may be shared with other files
+#define DI_ORPHAN 0x4   // on the orphan list, waiting to be freed
+#define DI_COMPRESSED 0x8  // data is compressed (read-only, see below)
+
+// An inode with no links whose blocks have yet to be freed is
+// an orphan. Orphans form a list, linked through dinode next,
+// that starts at the super block's orphan field, so that the
+// blocks of a file deleted just before a crash are still freed.
+
+// mkfs -z stores files compressed, in clusters of ZCLUSTER bytes
+// that are decompressed independently. Such a file's size is its
+// uncompressed size, but its blocks hold a stream: an index of
+// uint offsets of the n clusters in the stream, plus one for its
+// end, followed by the clusters. A cluster as long as its data
+// (ZCLUSTER, or what remains at the end of the file) is stored
+// as is; a shorter one is LZ-compressed, as a series of sequences:
+//   token: literal count << 4 | (match length - ZMINMATCH)
+//   more literal count bytes, if the count in the token is 15
+//   the literals
+//   match distance back from the end of the output, 2 bytes LE
+//   more match length bytes, if the length in the token is 15
+// where a count continues while its bytes are 255, and the last
+// sequence ends after its literals. Compressed files cannot be
+// written, only read and removed.
+#define ZCLUSTER 4096
+#define ZMINMATCH 4
 
 // On-disk inode structure
 struct dinode {
@@ -35,20 +84,33 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  ushort flags;         // DI_ flags
+  ushort next;          // Next inode on the orphan list
+  uint addrs[NDIRECT+1];   // Data block addresses, or inline data
 };
 
 // Inodes per block.
-#define IPB           (BSIZE / sizeof(struct dinode))
+#define IPB(sb)       ((sb).bsize / sizeof(struct dinode))
 
 // Block containing inode i
-#define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
+#define IBLOCK(i, sb)     ((i) / IPB(sb) + (sb).inodestart)
 
 // Bitmap bits per block
-#define BPB           (BSIZE*8)
+#define BPB(sb)       ((sb).bsize*8)
 
 // Block of free map containing bit for block b
-#define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
+#define BBLOCK(b, sb) ((b)/BPB(sb) + (sb).bmapstart)
+
+// Block of inode map containing bit for inode i
+#define IMBLOCK(i, sb) ((i)/BPB(sb) + (sb).imapstart)
+
+// A data block can be shared copy-on-write by several files.
+// The reference count table has a byte per block holding the
+// number of references beyond the first, up to MAXREF.
+#define MAXREF 255
+
+// Block of reference count table containing block b's count
+#define RBLOCK(b, sb) ((b)/(sb).bsize + (sb).refstart)
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -58,3 +120,81 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Directory entry as returned by getdents(). The name is
+// NUL-terminated; type and size are filled in only if
+// GD_STAT was passed, and are 0 otherwise.
+struct dirstat {
+  ushort inum;
+  short type;
+  uint size;
+  char name[DIRSIZ+2];
+};
+
+#define GD_STAT 0x1
+
+// Dirents per block
+#define DPB(sb)       ((sb).bsize / sizeof(struct dirent))
+
+// A directory with more than one block of entries is hash-indexed.
+// File block 0 of an indexed directory is the index: a dirindex
+// header followed by dirmaps giving the file block of each hash
+// bucket's first block. A bucket is a chain of blocks, each starting
+// with a dirnext header that links the chain's next block. Buckets
+// split one at a time (linear hashing) as the directory grows.
+// A split moves one chain block per dirlink(); while it is under
+// way, names of the newest bucket may still be in the chain of the
+// bucket it split from, from block split onward.
+// Every header has inum 0, so code that reads a directory as an
+// array of dirents sees only free entries where the headers are.
+#define DIRINDEX  0x6469  // dirindex magic
+#define DIRBUCKET 0x6462  // dirnext magic
+#define DIRMAPN   3       // buckets per dirmap
+#define MAXBUCKET(sb) ((DPB(sb) - 1) * DIRMAPN)
+#define DIRSPLIT(sb)  ((DPB(sb) - 1) * 3 / 4)  // entries per bucket before a split
+
+struct dirindex {
+  ushort inum;      // Always 0
+  ushort magic;     // DIRINDEX
+  uint nbucket;     // Number of buckets
+  uint nentry;      // Number of names in the directory
+  uint split;       // Next chain block of the bucket being split, or 0
+};
+
+struct dirmap {
+  ushort inum;      // Always 0
+  ushort unused;
+  uint bucket[DIRMAPN];  // File block of each bucket's first block
+};
+
+struct dirnext {
+  ushort inum;      // Always 0
+  ushort magic;     // DIRBUCKET
+  uint next;        // File block of the next block in the chain, or 0
+  uint unused[2];
+};
+
+// Hash of a directory entry name.
+static inline uint
+dirhash(const char *name)
+{
+  uint h = 5381;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 33 + (uchar)name[i];
+  return h;
+}
+
+// Bucket for hash h in an indexed directory with n buckets.
+static inline uint
+dirbucket(uint h, uint n)
+{
+  uint m = 1;
+
+  while(m * 2 <= n)
+    m *= 2;
+  if((h & (2*m - 1)) < n)
+    return h & (2*m - 1);
+  return h & (m - 1);
+}
+
@@ -6,6 +6,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -16,10 +17,31 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves log space for
+// MAXOPBLOCKS blocks; a system call that will write more,
+// such as a large write(), can use begin_opn()/end_opn() to
+// reserve as many as the log holds. Usually begin_op() just
+// increments the count of in-progress FS system calls and
+// returns. But if it thinks the log is close to running out,
+// it sleeps until the last outstanding end_op() commits.
+//
+// Otherwise end_op() does not commit, so a transaction groups
+// the updates of many system calls, and they return without
+// waiting for the disk. The writeback kernel thread commits a
+// transaction once its oldest update is LOGAGE ticks old or the
+// log is half full, and log_sync() commits on demand (fsync).
+// Transactions are numbered in order from 0; the one being
+// built is number log.committed.
+//
+// On a file system with the FS_ORDERED flag, file data
+// blocks are not logged. log_data() records them instead, and
+// commit() writes them to their home locations before it
+// commits the metadata that refers to them, so that each is
+// written once rather than twice. A block freed by the current
+// transaction, or shared and left with one fewer reference,
+// may still hold data of another file as of the last commit,
+// so it is logged as usual if written again before the
+// transaction commits.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -32,36 +54,57 @@
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
+// The header must fit in one block, which limits the log to
+// bsize/sizeof(int) blocks including the header.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[MAXBSIZE/sizeof(int) - 1];
 };
 
+#define NFREED 16  // ranges of freed blocks remembered per transaction
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int bsize;       // block size
   int outstanding; // how many FS sys calls are executing.
+  int reserved;    // log blocks reserved by executing FS sys calls.
+  int spacewait;   // a begin_opn() is waiting for log space.
   int committing;  // in commit(), please wait.
+  int syncing;     // log_sync() wants a commit; don't begin ops.
+  uint committed;  // number of transactions committed.
+  uint since;      // ticks when this transaction was first written.
+  int reclaim;     // log_reclaim() wants orphans freed.
   int dev;
   struct logheader lh;
+  int nd;          // number of ordered data blocks.
+  int data[MAXBSIZE/sizeof(int) - 1];  // their block numbers.
+  int nfreed;      // ranges in freed[], or NFREED+1 if too many.
+  struct {
+    uint lo, hi;
+  } freed[NFREED]; // blocks freed or unshared by this transaction.
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void writeback(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sb->nlog <= MAXOPBLOCKS || sb->nlog > sb->bsize/sizeof(int))
+    panic("initlog: bad log size");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.bsize = sb->bsize;
   log.dev = dev;
   recover_from_log();
+  if(kthread("writeback", writeback) < 0)
+    panic("initlog: writeback");
 }
 
 // Copy committed blocks from log to their home location
@@ -73,7 +116,7 @@ install_trans(int recovering)
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+    memmove(dbuf->data, lbuf->data, log.bsize);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
     if(recovering == 0)
       bunpin(dbuf);
@@ -122,58 +165,174 @@ recover_from_log(void)
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
-void
-begin_op(void)
+// Commit the current transaction.
+// Caller holds log.lock, and no FS sys calls are executing.
+static void
+docommit(void)
 {
+  log.committing = 1;
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  release(&log.lock);
+  commit();
+  acquire(&log.lock);
+  log.committing = 0;
+  log.committed += 1;
+  log.spacewait = 0;
+  wakeup(&log);
+}
+
+// called at the start of an FS system call that writes up
+// to n blocks. Returns the number of blocks reserved, which
+// is less than n if the log cannot hold n; the caller must
+// pass it to end_opn().
+int
+begin_opn(int n)
+{
+  if(n > log.size - 1)
+    n = log.size - 1;
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.syncing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.nd + log.reserved + n > log.size - 1){
       // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+      if(log.outstanding == 0){
+        docommit();
+      } else {
+        log.spacewait = 1;
+        sleep(&log, &log.lock);
+      }
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
-      break;
+      return n;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call.
 void
-end_op(void)
+begin_op(void)
 {
-  int do_commit = 0;
+  begin_opn(MAXOPBLOCKS);
+}
 
+// called at the end of an FS system call started with
+// begin_opn(), which returned n.
+// commits only if this was the last outstanding operation
+// and the log has no room for another.
+void
+end_opn(int n)
+{
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= n;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  if(log.outstanding == 0 && log.syncing == 0 &&
+     (log.lh.n + log.nd + MAXOPBLOCKS > log.size - 1 || log.spacewait)){
+    docommit();
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // begin_op() may be waiting for log space, and
+    // decrementing log.outstanding has decreased the
+    // amount of reserved space; log_sync() may be
+    // waiting for the last operation to finish.
     wakeup(&log);
   }
   release(&log.lock);
+}
+
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Return the number of the transaction being built, which
+// holds any update made by the caller's current FS system call.
+uint
+log_txn(void)
+{
+  uint t;
+
+  acquire(&log.lock);
+  t = log.committed;
+  release(&log.lock);
+  return t;
+}
+
+// Wait until transaction txn, and all before it, are on disk,
+// committing the current transaction if need be.
+// Must not be called inside begin_op()/end_op().
+void
+log_sync(uint txn)
+{
+  acquire(&log.lock);
+  log.syncing += 1;
+  while((int)(log.committed - txn) <= 0){
+    if(log.committing || log.outstanding > 0){
+      sleep(&log, &log.lock);
+    } else if(log.lh.n + log.nd == 0){
+      break;
+    } else {
+      docommit();
+    }
+  }
+  log.syncing -= 1;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// The writeback thread. It sleeps until the log holds updates,
+// then commits the transaction once its oldest update is LOGAGE
+// ticks old or the log is half full, so that an idle system is
+// not woken at all. It frees orphaned inodes when log_reclaim()
+// asks and after each commit, and at boot, those left by a crash.
+// logwake() and log_reclaim() wake it, on channel &log.since.
+static void
+writeback(void)
+{
+  uint age;
+  int n, due;
+
+  for(;;){
+    ireclaim(log.dev);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    due = 0;
+    while(!log.reclaim){
+      n = log.lh.n + log.nd;
+      if(n == 0){
+        sleep(&log.since, &log.lock);
+        continue;
+      }
+      age = nsnow() / TICKNS - log.since;
+      if(age >= LOGAGE || n >= (log.size - 1) / 2){
+        due = 1;
+        break;
+      }
+      sleeptimeout(&log.since, &log.lock, (uint64)(LOGAGE - age) * TICKNS);
+    }
+    log.reclaim = 0;
     release(&log.lock);
+    if(due)
+      log_sync(log_txn());
   }
 }
 
+// Wake the writeback thread to free orphaned inodes.
+void
+log_reclaim(void)
+{
+  acquire(&log.lock);
+  log.reclaim = 1;
+  wakeup(&log.since);
+  release(&log.lock);
+}
+
 // Copy modified blocks from cache to log.
 static void
 write_log(void)
@@ -183,16 +342,32 @@ write_log(void)
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
+    memmove(to->data, from->data, log.bsize);
     bwrite(to);  // write the log
     brelse(from);
     brelse(to);
   }
 }
 
+// Write ordered data blocks from cache to their home locations.
+static void
+write_data(void)
+{
+  int i;
+
+  for (i = 0; i < log.nd; i++) {
+    struct buf *b = bread(log.dev, log.data[i]);
+    bwrite(b);
+    bunpin(b);
+    brelse(b);
+  }
+  log.nd = 0;
+}
+
 static void
 commit()
 {
+  write_data();      // Data first, so metadata never refers to stale blocks
   if (log.lh.n > 0) {
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
@@ -200,6 +375,55 @@ commit()
     log.lh.n = 0;
     write_head();    // Erase the transaction from the log
   }
+  log.nfreed = 0;
+}
+
+// A block is about to be added to the transaction. Note the
+// time if it is the first, and wake the writeback thread if it
+// is the first or fills half the log. Caller holds log.lock.
+static void
+logwake(void)
+{
+  int n = log.lh.n + log.nd;
+
+  if(n == 0)
+    log.since = nsnow() / TICKNS;
+  if(n == 0 || n + 1 == (log.size - 1) / 2)
+    wakeup(&log.since);
+}
+
+// Add b to the transaction's logged blocks, taking it off the
+// ordered data list if it is there. Caller holds log.lock.
+static void
+logblock(struct buf *b)
+{
+  int i, pinned;
+
+  if (log.outstanding < 1)
+    panic("log_write outside of trans");
+
+  pinned = 0;
+  for (i = 0; i < log.nd; i++) {
+    if (log.data[i] == b->blockno) {
+      log.data[i] = log.data[--log.nd];
+      pinned = 1;
+      break;
+    }
+  }
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == b->blockno)   // log absorption
+      break;
+  }
+  log.lh.block[i] = b->blockno;
+  if (i == log.lh.n) {  // Add new block to log?
+    if(!pinned){
+      if(log.lh.n + log.nd >= log.size - 1)
+        panic("too big a transaction");
+      bpin(b);
+    }
+    logwake();
+    log.lh.n++;
+  }
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -213,24 +437,97 @@ commit()
 //   brelse(bp)
 void
 log_write(struct buf *b)
+{
+  acquire(&log.lock);
+  logblock(b);
+  release(&log.lock);
+}
+
+// Was block b freed, or a reference to it dropped, by the
+// current transaction? If so, the committed state may still
+// hold b's old contents for another file.
+// Caller holds log.lock.
+static int
+logfreed(uint b)
+{
+  int i;
+
+  if(log.nfreed > NFREED)
+    return 1;
+  for(i = 0; i < log.nfreed; i++)
+    if(b >= log.freed[i].lo && b <= log.freed[i].hi)
+      return 1;
+  return 0;
+}
+
+// Like log_write(), for a file data block on a file system with
+// FS_ORDERED: commit() will write b in place, before it commits,
+// unless b has been logged, freed or unshared in this transaction.
+void
+log_data(struct buf *b)
 {
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
-    panic("log_write outside of trans");
-
+    panic("log_data outside of trans");
   for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+    if (log.lh.block[i] == b->blockno)
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  if (i < log.lh.n || logfreed(b->blockno)) {
+    logblock(b);
+    release(&log.lock);
+    return;
+  }
+  for (i = 0; i < log.nd; i++) {
+    if (log.data[i] == b->blockno)   // absorption
+      break;
+  }
+  if (i == log.nd) {
+    if (log.lh.n + log.nd >= log.size - 1)
+      panic("too big a transaction");
     bpin(b);
-    log.lh.n++;
+    logwake();
+    log.data[log.nd++] = b->blockno;
+  }
+  release(&log.lock);
+}
+
+// Note that the current transaction freed block b or dropped
+// a reference to it.
+void
+log_free(uint b)
+{
+  int i;
+
+  acquire(&log.lock);
+  for(i = 0; i < log.nfreed && i < NFREED; i++){
+    if(b + 1 == log.freed[i].lo){
+      log.freed[i].lo = b;
+      break;
+    }
+    if(b >= log.freed[i].lo && b <= log.freed[i].hi + 1){
+      if(b > log.freed[i].hi)
+        log.freed[i].hi = b;
+      break;
+    }
+  }
+  if(i == log.nfreed){
+    if(i < NFREED)
+      log.freed[i].lo = log.freed[i].hi = b;
+    log.nfreed++;  // NFREED+1: too many to remember
   }
   release(&log.lock);
 }
 
+// Report the state of the log, for logstat().
+void
+logstat(struct logstat *st)
+{
+  acquire(&log.lock);
+  st->ncommit = log.committed;
+  st->nblock = log.lh.n + log.nd;
+  st->size = log.size;
+  release(&log.lock);
+}
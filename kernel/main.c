@@ -21,11 +21,14 @@ main()
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
+    timersinit();    // kernel timers
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    dcinit();        // directory entry cache
+    zinit();         // decompressed cluster cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
@@ -2,12 +2,19 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // initial size of the in-memory inode table
+#define NDENTRY     200  // size of directory entry cache
+#define NZCACHE       8  // decompressed clusters of compressed files cached
+#define NDEDUP      256  // block hashes remembered for deduplication
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*3)  // default number of log blocks
+#define LOGAGE       10  // ticks before the writeback thread commits
+#define TICKNS       100000000  // ns per clock tick
+#define NPRIO         3  // scheduling priority levels
+#define NICEMAX      19  // largest (least favoured) nice value
+#define NBUF         (MAXOPBLOCKS*3)  // initial size of disk block cache
+#define FSSIZE       1000  // default size of file system in blocks
 #define MAXPATH      128   // maximum file path name
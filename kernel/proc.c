@@ -4,6 +4,8 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "stat.h"
+#include "timer.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
@@ -17,6 +19,9 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void ready(struct proc *p);
+static int toplevel(struct proc *p);
+static void waitqinit(void);
 
 extern char trampoline[]; // trampoline.S
 
@@ -47,9 +52,13 @@ void
 procinit(void)
 {
   struct proc *p;
+  struct cpu *c;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  waitqinit();
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rqlock, "runq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->kstack = KSTACK((int) (p - proc));
@@ -119,6 +128,11 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->cpu = cpuid();  // first runs here, unless another cpu steals it
+  p->nice = 0;
+  p->prio = 0;
+  p->used = 0;
+  p->cputime = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -242,9 +256,39 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  ready(p);
+
+  release(&p->lock);
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread running fn, which must not return.
+// A kernel thread has no user memory and never leaves the kernel.
+int
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
 
+  if((p = allocproc()) == 0)
+    return -1;
+  p->context.ra = (uint64)kthreadstart;
+  p->kfn = fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  ready(p);
   release(&p->lock);
+  return 0;
 }
 
 // Grow or shrink user memory by n bytes.
@@ -303,6 +347,9 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->nice = p->nice;
+  np->prio = toplevel(np);
+
   pid = np->pid;
 
   release(&np->lock);
@@ -312,7 +359,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  ready(np);
   release(&np->lock);
 
   return pid;
@@ -427,10 +474,240 @@ wait(uint64 addr)
   }
 }
 
+// Run queues.
+//
+// Each CPU has a run queue of the RUNNABLE processes waiting for
+// it. A process that becomes RUNNABLE joins the queue of the CPU
+// it last ran on, whose caches may still hold its data; a new
+// process joins the queue of the CPU that created it. A CPU whose
+// queue is empty steals from the longest queue of another CPU.
+//
+// The queues are multilevel feedback queues: each holds a FIFO
+// list for each of NPRIO priority levels, and a CPU runs the
+// first process at the highest level that has one. A process
+// starts at the top level its nice value allows (toplevel()),
+// and may use quantum() of CPU time at a level, in one go or in
+// bursts between sleeps, before it moves down one. So CPU-bound
+// processes sink, while interactive ones, which sleep before
+// they use up their quantum, stay high and run soon after they
+// wake; ready() preempts a lower-level process if no CPU is idle.
+// The quantum also shrinks as the nice value grows, so that
+// processes that share a level, CPU-bound ones at the bottom in
+// particular, share the CPU in proportion to NICEMAX+1-nice.
+// Every BOOSTNS, a CPU moves the processes on its queue back up
+// to their top level, so that those at the bottom do not starve.
+//
+// A process is on a run queue exactly when it is RUNNABLE, except
+// that one that yields is put back by the scheduler after it has
+// switched away from it. Both p->lock and the queue's rqlock are
+// held to put p on a queue, but only rqlock to take it off: the
+// CPU that does so then acquires p->lock, waiting if need be for
+// the CPU that p is leaving to finish switching away from it, and
+// is the only one that can run p. So p->lock is always acquired
+// before rqlock, never after.
+//
+// A CPU with nothing to run waits for an interrupt with wfi (see
+// idle()). ready() sends a software interrupt to wake it when it
+// has work: either a process on its own queue, or one on the
+// queue of a CPU that is busy, for it to steal.
+
+#define QUANTUM 10000000     // ns at level 0; doubles at each level down
+#define BOOSTNS 1000000000   // ns between boosts
+
+static uint64
+quantum(struct proc *p)
+{
+  return ((uint64)QUANTUM << p->prio) * (NICEMAX + 1 - p->nice) / (NICEMAX + 1);
+}
+
+// The highest level p may have, given its nice value.
+static int
+toplevel(struct proc *p)
+{
+  return p->nice * NPRIO / (NICEMAX + 1);
+}
+
+// Put p on the tail of its level's list in c's run queue.
+// Caller must hold c->rqlock.
+static void
+runqappend(struct cpu *c, struct proc *p)
+{
+  p->rqnext = 0;
+  if(c->rqtail[p->prio])
+    c->rqtail[p->prio]->rqnext = p;
+  else
+    c->rqhead[p->prio] = p;
+  c->rqtail[p->prio] = p;
+}
+
+// Put p on c's run queue.
+static void
+runqput(struct cpu *c, struct proc *p)
+{
+  acquire(&c->rqlock);
+  runqappend(c, p);
+  c->rqlen++;
+  release(&c->rqlock);
+}
+
+// Take the first process at the highest level of c's run
+// queue, or return 0 if it is empty.
+static struct proc*
+runqget(struct cpu *c)
+{
+  struct proc *p;
+  int i;
+
+  p = 0;
+  acquire(&c->rqlock);
+  for(i = 0; i < NPRIO; i++){
+    if((p = c->rqhead[i]) != 0){
+      c->rqhead[i] = p->rqnext;
+      if(c->rqhead[i] == 0)
+        c->rqtail[i] = 0;
+      c->rqlen--;
+      break;
+    }
+  }
+  release(&c->rqlock);
+  return p;
+}
+
+// Move each process on c's run queue to its top level, in
+// order of level. Reads p->nice without p->lock; a process
+// whose nice value is being changed at the same time may be
+// put at the old one's level until the next boost.
+static void
+boost(struct cpu *c)
+{
+  struct proc *list[NPRIO], *p, *next;
+  int i;
+
+  acquire(&c->rqlock);
+  for(i = 0; i < NPRIO; i++){
+    list[i] = c->rqhead[i];
+    c->rqhead[i] = c->rqtail[i] = 0;
+  }
+  for(i = 0; i < NPRIO; i++){
+    for(p = list[i]; p; p = next){
+      next = p->rqnext;
+      p->prio = toplevel(p);
+      p->used = 0;
+      runqappend(c, p);
+    }
+  }
+  release(&c->rqlock);
+}
+
+// Interrupt cpu c, to wake it from wfi.
+static void
+kick(struct cpu *c)
+{
+  *(volatile uint32*)CLINT_MSIP(c - cpus) = 1;
+}
+
+// Make p RUNNABLE and put it on the run queue of the cpu it
+// last ran on. Wake that cpu if it is idle, or else another
+// idle cpu to steal p, or else preempt the process that cpu
+// is running if it is at a lower level than p.
+// Caller must hold p->lock.
+static void
+ready(struct proc *p)
+{
+  struct cpu *c = &cpus[p->cpu];
+  struct cpu *v;
+
+  p->state = RUNNABLE;
+  runqput(c, p);
+
+  // Pairs with the barrier in idle().
+  __sync_synchronize();
+  if(c->idle){
+    kick(c);
+    return;
+  }
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v->idle){
+      kick(v);
+      return;
+    }
+  }
+  if(c->proc && c->runprio > p->prio){
+    c->resched = 1;
+    kick(c);
+  }
+}
+
+// Take a process from the longest run queue of a cpu other
+// than c, or return 0 if they are all empty. The lengths are
+// read without locks, as a hint.
+static struct proc*
+steal(struct cpu *c)
+{
+  struct cpu *v, *busiest;
+  struct proc *p;
+
+  busiest = 0;
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v != c && v->rqlen > 0 && (busiest == 0 || v->rqlen > busiest->rqlen))
+      busiest = v;
+  }
+  if(busiest == 0 || (p = runqget(busiest)) == 0)
+    return 0;
+  c->nsteal++;
+  return p;
+}
+
+// Wait for an interrupt, unless some run queue holds a process.
+// The cpu is marked idle before it looks, and interrupts are off
+// until after the wfi, so that ready() either puts a process
+// where the cpu will see it, or sees the mark and sends an
+// interrupt that ends the wfi rather than being taken before it.
+static void
+idle(struct cpu *c)
+{
+  struct cpu *v;
+  uint64 t0;
+
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  for(v = cpus; v < &cpus[NCPU]; v++)
+    if(v->rqlen > 0)
+      break;
+  if(v == &cpus[NCPU]){
+    t0 = nsnow();
+    wfi();
+    c->idlens += nsnow() - t0;
+  }
+  c->idle = 0;
+  intr_on();
+}
+
+// Charge p, which has just stopped running, for the CPU time
+// it used, moving it down a level if it has used up its
+// quantum at this one. Caller must hold p->lock.
+static void
+charge(struct proc *p)
+{
+  uint64 t;
+
+  t = nsnow() - p->runstart;
+  p->cputime += t;
+  p->used += t;
+  if(p->used >= quantum(p)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->used = 0;
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take the highest-priority process from this cpu's
+//    run queue, or from another cpu's if this one's is
+//    empty, or wait for an interrupt if they all are.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -441,26 +718,47 @@ scheduler(void)
   struct cpu *c = mycpu();
   
   c->proc = 0;
+  c->started = 1;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if(nsnow() >= c->boostat){
+      boost(c);
+      c->boostat = nsnow() + BOOSTNS;
     }
+
+    c->resched = 0;
+    if((p = runqget(c)) == 0 && (p = steal(c)) == 0){
+      idle(c);
+      continue;
+    }
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = cpuid();
+    c->proc = p;
+    c->runprio = p->prio;
+    c->nswtch++;
+    p->runstart = nsnow();
+    c->sliceend = p->runstart + quantum(p) - p->used;
+    clockarm();
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    c->sliceend = 0;
+    charge(p);
+    if(p->state == RUNNABLE)
+      runqput(c, p);  // it yielded
+    release(&p->lock);
   }
 }
 
@@ -492,6 +790,7 @@ sched(void)
 }
 
 // Give up the CPU for one scheduling round.
+// The scheduler puts p back on its run queue.
 void
 yield(void)
 {
@@ -523,53 +822,180 @@ forkret(void)
   usertrapret();
 }
 
-// Atomically release lock and sleep on chan.
+// Wait queues.
+//
+// A sleeping process waits on the queue that its channel hashes
+// to, so that wakeup() looks only at the processes sleeping on
+// channels in the same bucket rather than at the whole process
+// table. Each queue is a FIFO, so wakeupone() wakes the process
+// that has waited longest.
+//
+// A process is on a queue only while it is in sleep(). Both the
+// queue's lock and p->lock are held to put p on it. wakeup()
+// takes p off under both too, but kill() wakes p without the
+// queue's lock, so sleep() takes p off itself if need be. The
+// queue's lock is always acquired before p->lock.
+
+#define NWAITQ 64
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;     // through p->wnext and p->wprev
+  struct proc *tail;
+} waitq[NWAITQ];
+
+static void
+waitqinit(void)
+{
+  struct waitq *q;
+
+  for(q = waitq; q < &waitq[NWAITQ]; q++)
+    initlock(&q->lock, "waitq");
+}
+
+static struct waitq*
+chanq(void *chan)
+{
+  uint64 h = (uint64)chan;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return &waitq[h % NWAITQ];
+}
+
+static void
+waitqdel(struct waitq *q, struct proc *p)
+{
+  if(p->wprev)
+    p->wprev->wnext = p->wnext;
+  else
+    q->head = p->wnext;
+  if(p->wnext)
+    p->wnext->wprev = p->wprev;
+  else
+    q->tail = p->wprev;
+  p->wnext = p->wprev = 0;
+  p->wq = 0;
+}
+
+// Atomically release lock and sleep on chan, unless t is
+// non-zero and has already gone off.
 // Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+static void
+sleep1(void *chan, struct spinlock *lk, struct timer *t)
 {
   struct proc *p = myproc();
+  struct waitq *q = chanq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold q->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks q->lock), including t's,
   // so it's okay to release lk.
 
+  acquire(&q->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
+  if(t && !t->pending){
+    release(&q->lock);
+    release(&p->lock);
+    acquire(lk);
+    return;
+  }
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wnext = 0;
+  p->wprev = q->tail;
+  if(q->tail)
+    q->tail->wnext = p;
+  else
+    q->head = p;
+  q->tail = p;
+  p->wq = q;
+  release(&q->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // Still on q if kill() woke us.
+  acquire(&q->lock);
+  if(p->wq)
+    waitqdel(q, p);
+  release(&q->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
 void
-wakeup(void *chan)
+sleep(void *chan, struct spinlock *lk)
 {
-  struct proc *p;
+  sleep1(chan, lk, 0);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+// Like sleep(), but wake up after ns nanoseconds if nothing
+// else has woken us by then. Returns -1 if the time ran out.
+int
+sleeptimeout(void *chan, struct spinlock *lk, uint64 ns)
+{
+  struct timer t;
+
+  timeradd(&t, chan, ns);
+  sleep1(chan, lk, &t);
+  return timerdel(&t) ? 0 : -1;
+}
+
+// Wake up at most n processes sleeping on chan, the
+// longest-waiting first. Returns the number woken.
+static int
+wakeupn(void *chan, int n)
+{
+  struct waitq *q = chanq(chan);
+  struct proc *p, *next;
+  int woken = 0;
+
+  acquire(&q->lock);
+  for(p = q->head; p && woken < n; p = next){
+    next = p->wnext;
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        waitqdel(q, p);
+        ready(p);
+        woken++;
       }
       release(&p->lock);
     }
   }
+  release(&q->lock);
+  return woken;
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void
+wakeup(void *chan)
+{
+  wakeupn(chan, NPROC);
+}
+
+// Wake up the process that has slept longest on chan,
+// for when only one of them could make progress.
+// Must be called without any p->lock.
+void
+wakeupone(void *chan)
+{
+  wakeupn(chan, 1);
 }
 
 // Kill the process with the given pid.
@@ -585,8 +1011,9 @@ kill(int pid)
     if(p->pid == pid){
       p->killed = 1;
       if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+        // Wake process from sleep(), which takes
+        // it off its wait queue.
+        ready(p);
       }
       release(&p->lock);
       return 0;
@@ -626,6 +1053,78 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// Set the nice value of process pid, or of the caller if pid
+// is 0, to nice, from 0 to NICEMAX; the higher it is, the lower
+// the priority levels the process may have, and the shorter its
+// quantum at each. Returns the old nice value, or -1.
+int
+setpriority(int pid, int nice)
+{
+  struct proc *p;
+  int old;
+
+  if(nice < 0 || nice > NICEMAX)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid){
+      old = p->nice;
+      p->nice = nice;
+      // Start a quantum of the new length. A process on a run
+      // queue moves to its new top level at the next boost.
+      p->used = 0;
+      if(p->state != RUNNABLE)
+        p->prio = toplevel(p);
+      release(&p->lock);
+      return old;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Return the CPU time the calling process has used, in ns,
+// including that of its current turn on the cpu.
+uint64
+cputime(void)
+{
+  struct proc *p = myproc();
+  uint64 t;
+
+  acquire(&p->lock);
+  t = p->cputime + (nsnow() - p->runstart);
+  release(&p->lock);
+  return t;
+}
+
+// Copy the scheduling statistics of up to n cpus that have
+// started to the array of struct cpustat at user address addr.
+// Returns the number copied, or -1.
+int
+cpustat(uint64 addr, int n)
+{
+  struct cpustat st;
+  struct cpu *c;
+  int i;
+
+  i = 0;
+  for(c = cpus; c < &cpus[NCPU] && i < n; c++){
+    if(!c->started)
+      continue;
+    st.cpu = c - cpus;
+    st.rqlen = c->rqlen;
+    st.nswtch = c->nswtch;
+    st.nsteal = c->nsteal;
+    st.idlens = c->idlens;
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+    i++;
+  }
+  return i;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -640,6 +1139,7 @@ procdump(void)
   [ZOMBIE]    "zombie"
   };
   struct proc *p;
+  struct cpu *c;
   char *state;
 
   printf("\n");
@@ -651,6 +1151,14 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" prio %d nice %d cpu %dms", p->prio, p->nice,
+           (int)(p->cputime / 1000000));
     printf("\n");
   }
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c->started)
+      printf("cpu %d: runq %d switches %d steals %d idle %dms\n",
+             (int)(c - cpus), c->rqlen, (int)c->nswtch, (int)c->nsteal,
+             (int)(c->idlens / 1000000));
+  }
 }
@@ -24,6 +24,23 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int started;                // Has this cpu entered scheduler()?
+  int idle;                   // Waiting in wfi for work? See idle().
+  uint64 sliceend;            // When proc's time slice ends (ns), or 0
+  int runprio;                // proc's priority level
+  int resched;                // Preempt proc for a higher-priority process?
+  uint64 boostat;             // When to next boost the run queue (ns)
+
+  // rqlock must be held when using these:
+  struct spinlock rqlock;
+  struct proc *rqhead[NPRIO]; // Run queue of RUNNABLE processes for each
+  struct proc *rqtail[NPRIO]; // priority level, through rqnext
+  int rqlen;                  // Number of processes on the run queue
+
+  // Scheduling statistics, updated only by this cpu.
+  uint64 nswtch;              // Context switches to a process
+  uint64 nsteal;              // Processes taken from other cpus' run queues
+  uint64 idlens;              // Time spent idle, in ns
 };
 
 extern struct cpu cpus[NCPU];
@@ -92,6 +109,21 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU p last ran on, whose run queue it joins
+  int nice;                    // 0 to NICEMAX, see setpriority()
+  uint64 cputime;              // CPU time used, in ns
+  uint64 runstart;             // When p last started running (ns)
+
+  // p->lock must be held when using these, or while p is on
+  // a run queue, the queue's rqlock:
+  int prio;                    // Priority level, 0 (highest) to NPRIO-1
+  uint64 used;                 // CPU time used at this level (ns)
+  struct proc *rqnext;         // Next process on the run queue
+
+  // the wait queue's lock must be held when using these:
+  struct waitq *wq;            // Wait queue p is on while in sleep()
+  struct proc *wnext;          // Next and previous on the wait queue
+  struct proc *wprev;
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -105,4 +137,5 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Kernel thread function, if a kernel thread
 };
@@ -331,6 +331,14 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// wait for an interrupt. one that sie enables ends
+// the wait even if device interrupts are disabled.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
@@ -9,3 +9,19 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// Scheduling statistics of a CPU, as returned by cpustat().
+struct cpustat {
+  int cpu;       // CPU (hart) number
+  int rqlen;     // Processes waiting on its run queue
+  uint64 nswtch; // Context switches to a process
+  uint64 nsteal; // Processes it took from other CPUs' run queues
+  uint64 idlens; // Time it has spent idle, in ns
+};
+
+// State of the file system log, as returned by logstat().
+struct logstat {
+  uint ncommit;  // Transactions committed
+  int nblock;    // Blocks in the transaction being built
+  int size;      // Blocks the log can hold
+};
@@ -104,6 +104,19 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
+extern uint64 sys_getdents(void);
+extern uint64 sys_lseek(void);
+extern uint64 sys_fallocate(void);
+extern uint64 sys_copy_file_range(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_fdatasync(void);
+extern uint64 sys_cpustat(void);
+extern uint64 sys_uptimens(void);
+extern uint64 sys_sleepns(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_cputime(void);
+extern uint64 sys_logstat(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -127,6 +140,19 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_getdents] sys_getdents,
+[SYS_lseek]   sys_lseek,
+[SYS_fallocate] sys_fallocate,
+[SYS_copy_file_range] sys_copy_file_range,
+[SYS_splice]  sys_splice,
+[SYS_fsync]   sys_fsync,
+[SYS_fdatasync] sys_fdatasync,
+[SYS_cpustat] sys_cpustat,
+[SYS_uptimens] sys_uptimens,
+[SYS_sleepns] sys_sleepns,
+[SYS_setpriority] sys_setpriority,
+[SYS_cputime] sys_cputime,
+[SYS_logstat] sys_logstat,
 };
 
 void
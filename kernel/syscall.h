@@ -20,3 +20,16 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_getdents 22
+#define SYS_lseek  23
+#define SYS_fallocate 24
+#define SYS_copy_file_range 25
+#define SYS_splice 26
+#define SYS_fsync 27
+#define SYS_fdatasync 28
+#define SYS_cpustat 29
+#define SYS_uptimens 30
+#define SYS_sleepns 31
+#define SYS_setpriority 32
+#define SYS_cputime 33
+#define SYS_logstat 34
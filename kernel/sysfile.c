@@ -75,7 +75,7 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
-  return fileread(f, p, n);
+  return fileread(f, 1, p, n);
 }
 
 uint64
@@ -88,7 +88,7 @@ sys_write(void)
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  return filewrite(f, 1, p, n);
 }
 
 uint64
@@ -115,6 +115,256 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Read up to n entries of the directory open as fd into an
+// array of struct dirstat, continuing from the file offset.
+// Returns the number of entries read, 0 at the end of the
+// directory.
+uint64
+sys_getdents(void)
+{
+  struct file *f;
+  struct inode *dp, *ip[16];
+  struct dirent de[16];
+  struct dirstat ds;
+  uint64 addr;
+  int n, flags, got, m, i, k, err;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &addr) < 0 || argint(2, &n) < 0 ||
+     argint(3, &flags) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable || n < 0)
+    return -1;
+  dp = f->ip;
+
+  err = 0;
+  for(got = 0; got < n; got += m){
+    // Collect a batch of entries with dp locked, taking a
+    // reference to each inode so that it cannot be freed.
+    ilock(dp);
+    if(dp->type != T_DIR){
+      iunlock(dp);
+      return -1;
+    }
+    k = readi(dp, 0, (uint64)de, f->off, sizeof(de)) / sizeof(de[0]);
+    m = 0;
+    for(i = 0; i < k && got + m < n; i++){
+      f->off += sizeof(de[i]);
+      if(de[i].inum == 0)
+        continue;
+      de[m] = de[i];
+      ip[m] = (flags & GD_STAT) ? iget(dp->dev, de[i].inum) : 0;
+      m++;
+    }
+    iunlock(dp);
+    if(k == 0)
+      break;
+
+    // Lock the inodes only after releasing dp, since an entry
+    // may be dp itself or its parent.
+    if(flags & GD_STAT)
+      begin_op();
+    for(i = 0; i < m; i++){
+      memset(&ds, 0, sizeof(ds));
+      ds.inum = de[i].inum;
+      memmove(ds.name, de[i].name, DIRSIZ);
+      if(ip[i]){
+        ilock(ip[i]);
+        ds.type = ip[i]->type;
+        ds.size = ip[i]->size;
+        iunlockput(ip[i]);
+      }
+      if(!err && copyout(myproc()->pagetable, addr + (got+i)*sizeof(ds),
+                         (char*)&ds, sizeof(ds)) < 0)
+        err = 1;
+    }
+    if(flags & GD_STAT)
+      end_op();
+    if(err)
+      return -1;
+  }
+  return got;
+}
+
+// Set the offset of fd to off bytes from the start of the
+// file, the current offset, or the end of the file, according
+// to whence. The offset may lie beyond the end of the file;
+// writing there leaves a hole. Returns the new offset.
+uint64
+sys_lseek(void)
+{
+  struct file *f;
+  int off, whence;
+  uint base;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &whence) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+
+  switch(whence){
+  case SEEK_SET:
+    base = 0;
+    break;
+  case SEEK_CUR:
+    base = f->off;
+    break;
+  case SEEK_END:
+    ilock(f->ip);
+    base = f->ip->size;
+    iunlock(f->ip);
+    break;
+  default:
+    return -1;
+  }
+  if((int)base + off < 0)
+    return -1;
+  f->off = base + off;
+  return f->off;
+}
+
+// Allocate blocks for len bytes of fd starting at off, or with
+// FALLOC_FL_PUNCH_HOLE free them. Allocation extends the file
+// unless FALLOC_FL_KEEP_SIZE is given.
+uint64
+sys_fallocate(void)
+{
+  struct file *f;
+  int mode, off, len, r;
+  uint n, max;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &mode) < 0 || argint(2, &off) < 0 ||
+     argint(3, &len) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->writable || off < 0 || len < 0)
+    return -1;
+  if(mode & ~(FALLOC_FL_KEEP_SIZE|FALLOC_FL_PUNCH_HOLE))
+    return -1;
+  if((mode & FALLOC_FL_PUNCH_HOLE) == 0 && (uint)off + len > maxfilesize(f->ip->dev))
+    return -1;
+
+  // A few blocks per transaction, as in filewrite().
+  max = ((MAXOPBLOCKS-1-1-2) / 2) * bsize(f->ip->dev);
+  r = 0;
+  while(len > 0 && r == 0){
+    n = max - off % bsize(f->ip->dev);
+    if(n > len)
+      n = len;
+    begin_op();
+    ilock(f->ip);
+    if(f->ip->type != T_FILE)
+      r = -1;
+    else if(mode & FALLOC_FL_PUNCH_HOLE)
+      r = ipunch(f->ip, off, n);
+    else
+      r = ifalloc(f->ip, off, n, mode & FALLOC_FL_KEEP_SIZE);
+    iunlock(f->ip);
+    end_op();
+    off += n;
+    len -= n;
+  }
+  return r;
+}
+
+// Copy up to len bytes from fdin to fdout, starting at and
+// advancing each file's offset, without passing the data
+// through user space. Returns the number of bytes copied,
+// which is less than len only at the end of fdin.
+uint64
+sys_copy_file_range(void)
+{
+  struct file *fin, *fout;
+  struct inode *a, *b;
+  int len, r, tot;
+
+  if(argfd(0, 0, &fin) < 0 || argfd(1, 0, &fout) < 0 || argint(2, &len) < 0)
+    return -1;
+  if(fin->type != FD_INODE || fout->type != FD_INODE || !fin->readable ||
+     !fout->writable || fin->ip == fout->ip || len < 0)
+    return -1;
+
+  // Lock the inodes in inode number order, to avoid deadlock.
+  a = fin->ip;
+  b = fout->ip;
+  if(a->inum > b->inum){
+    a = fout->ip;
+    b = fin->ip;
+  }
+
+  // icopy() copies as much as fits in one transaction.
+  for(tot = 0; tot < len; tot += r){
+    begin_op();
+    ilock(a);
+    ilock(b);
+    if(fin->ip->type != T_FILE || fout->ip->type != T_FILE)
+      r = -1;
+    else
+      r = icopy(fout->ip, fout->off, fin->ip, fin->off, len - tot);
+    if(r > 0){
+      fin->off += r;
+      fout->off += r;
+    }
+    iunlock(b);
+    iunlock(a);
+    end_op();
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+    if(r == 0)
+      break;
+  }
+  return tot;
+}
+
+// Move up to n bytes from fdin to fdout within the kernel,
+// as if by read() and write() through a buffer.
+uint64
+sys_splice(void)
+{
+  struct file *fin, *fout;
+  int n;
+
+  if(argfd(0, 0, &fin) < 0 || argfd(1, 0, &fout) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(fin, fout, n);
+}
+
+// Return once all updates to fd are on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f, 0);
+}
+
+// Return once fd's data is on disk, but not necessarily
+// updates only to its other metadata, such as its link count.
+uint64
+sys_fdatasync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f, 1);
+}
+
+// Copy the state of the log to the struct logstat at addr.
+uint64
+sys_logstat(void)
+{
+  struct logstat st;
+  uint64 addr;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  logstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -165,27 +415,10 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int
-isdirempty(struct inode *dp)
-{
-  int off;
-  struct dirent de;
-
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
-  }
-  return 1;
-}
-
 uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -215,9 +448,7 @@ sys_unlink(void)
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -322,6 +553,13 @@ sys_open(void)
     return -1;
   }
 
+  // Compressed files are read-only.
+  if((ip->flags & DI_COMPRESSED) && (omode & (O_WRONLY|O_RDWR|O_TRUNC))){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
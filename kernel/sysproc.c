@@ -52,27 +52,49 @@ sys_sbrk(void)
   return addr;
 }
 
-uint64
-sys_sleep(void)
+// Sleep for ns nanoseconds, or until killed.
+static int
+sleepfor(uint64 ns)
 {
-  int n;
-  uint ticks0;
+  uint64 now, end;
 
-  if(argint(0, &n) < 0)
-    return -1;
+  end = nsnow() + ns;
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  while((now = nsnow()) < end){
     if(myproc()->killed){
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    // end is this process's own channel, so only the
+    // timer (or kill) wakes it.
+    sleeptimeout(&end, &tickslock, end - now);
   }
   release(&tickslock);
   return 0;
 }
 
+uint64
+sys_sleep(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  if(n < 0)
+    n = 0;
+  return sleepfor((uint64)n * TICKNS);
+}
+
+uint64
+sys_sleepns(void)
+{
+  uint64 ns;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  return sleepfor(ns);
+}
+
 uint64
 sys_kill(void)
 {
@@ -83,15 +105,49 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+uint64
+sys_cpustat(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return cpustat(addr, n);
+}
+
+uint64
+sys_setpriority(void)
+{
+  int pid, nice;
+
+  if(argint(0, &pid) < 0 || argint(1, &nice) < 0)
+    return -1;
+  return setpriority(pid, nice);
+}
+
+uint64
+sys_cputime(void)
+{
+  return cputime();
+}
+
+// return how many clock ticks have passed
 // since start.
 uint64
 sys_uptime(void)
 {
   uint xticks;
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
+  // ticks itself is only brought up to date by clock
+  // interrupts, which an idle machine does not take.
+  xticks = nsnow() / TICKNS;
   return xticks;
 }
+
+// return nanoseconds since start.
+uint64
+sys_uptimens(void)
+{
+  return nsnow();
+}
@@ -0,0 +1,240 @@
+// Kernel timers and the clock.
+//
+// A timer wakes up the processes sleeping on its channel at a
+// given time, measured in nanoseconds since boot by nsnow().
+// sleeptimeout() in proc.c uses one to bound a sleep;
+// sys_sleep() and sys_sleepns() sleep on a private channel, so
+// that their process is woken exactly once, when its time is up.
+//
+// The clock is tickless. Rather than interrupting every CPU at
+// a fixed rate, each CPU programs its CLINT timer compare
+// register for its next deadline: the earliest of the timers
+// started on it, or the end of the running process's time
+// slice, whichever comes first. A CPU is thus interrupted only
+// for its own timers, and an idle CPU with none pending is not
+// interrupted at all. Each clock interrupt fires the CPU's
+// timers that have expired and programs its next deadline; the
+// processes they wake may run on any CPU.
+//
+// Each CPU keeps its pending timers in a timing wheel: an array
+// of NSLOT lists, a timer that expires in the s'th SLOTNS-long
+// interval since boot being on list s % NSLOT. timertick() looks
+// only at the lists for the intervals since it last ran, and
+// fires the timers on them that have expired; the others are
+// at least one turn of the wheel away. Adding and deleting a
+// timer take constant time.
+//
+// A wheel's lock protects it and the pending, slot, next and
+// prev of every timer on it; a timer's cpu, set when it is
+// added, says which wheel that is. timertick() holds the lock
+// while it calls wakeup(), so it is acquired before any wait
+// queue or process lock.
+//
+// Interface:
+// * nsnow() to read the clock.
+// * timeradd() to start a timer, timerdel() to stop it.
+// * clockintr() from the clock interrupt, clockarm() when a
+//   cpu's next deadline may have changed.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+#include "timer.h"
+
+#define NSLOT 64
+#define SLOTNS 10000000  // 10 ms
+#define NEVER (~(uint64)0)
+
+struct wheel {
+  struct spinlock lock;
+  uint64 done;                 // intervals before this one have fired
+  struct timer *slot[NSLOT];
+} wheels[NCPU];
+
+void
+timersinit(void)
+{
+  struct wheel *w;
+
+  for(w = wheels; w < &wheels[NCPU]; w++)
+    initlock(&w->lock, "timers");
+}
+
+// Nanoseconds since boot.
+uint64
+nsnow(void)
+{
+  return *(volatile uint64*)CLINT_MTIME * CLINT_NS;
+}
+
+// The time of the earliest timer pending on w, or NEVER.
+// Caller must hold w->lock.
+static uint64
+timernext(struct wheel *w)
+{
+  struct timer *t;
+  uint64 s, min;
+  int i;
+
+  // The first interval with a timer in this turn of the wheel.
+  for(s = w->done; s < w->done + NSLOT; s++){
+    min = NEVER;
+    for(t = w->slot[s % NSLOT]; t; t = t->next)
+      if(t->expires < (s+1)*SLOTNS && t->expires < min)
+        min = t->expires;
+    if(min != NEVER)
+      return min;
+  }
+
+  // All are more than a turn away.
+  min = NEVER;
+  for(i = 0; i < NSLOT; i++)
+    for(t = w->slot[i]; t; t = t->next)
+      if(t->expires < min)
+        min = t->expires;
+  return min;
+}
+
+// Program this cpu's timer for its next deadline.
+// Caller must have interrupts off.
+void
+clockarm(void)
+{
+  struct cpu *c = mycpu();
+  struct wheel *w = &wheels[cpuid()];
+  uint64 when;
+
+  acquire(&w->lock);
+  when = timernext(w);
+  release(&w->lock);
+  if(c->sliceend && c->sliceend < when)
+    when = c->sliceend;
+  if(when == NEVER)
+    *(uint64*)CLINT_MTIMECMP(cpuid()) = NEVER;
+  else
+    *(uint64*)CLINT_MTIMECMP(cpuid()) = (when + CLINT_NS - 1) / CLINT_NS;
+}
+
+// Start timer t, on this cpu, to wake up chan ns nanoseconds
+// from now. t must not be pending.
+void
+timeradd(struct timer *t, void *chan, uint64 ns)
+{
+  struct wheel *w;
+  struct timer **l;
+  uint64 s;
+  int first;
+
+  push_off();
+  t->cpu = cpuid();
+  w = &wheels[t->cpu];
+  acquire(&w->lock);
+  t->expires = nsnow() + ns;
+  t->chan = chan;
+  t->pending = 1;
+  s = t->expires / SLOTNS;
+  if(s < w->done)
+    s = w->done;  // already late
+  t->slot = s % NSLOT;
+  l = &w->slot[t->slot];
+  t->prev = 0;
+  t->next = *l;
+  if(*l)
+    (*l)->prev = t;
+  *l = t;
+  first = timernext(w) == t->expires;
+  release(&w->lock);
+  if(first)
+    clockarm();
+  pop_off();
+}
+
+static void
+timerunlink(struct wheel *w, struct timer *t)
+{
+  if(t->prev)
+    t->prev->next = t->next;
+  else
+    w->slot[t->slot] = t->next;
+  if(t->next)
+    t->next->prev = t->prev;
+  t->pending = 0;
+}
+
+// Stop timer t, if it has not gone off.
+// Returns 1 if it was pending, 0 if it had gone off.
+int
+timerdel(struct timer *t)
+{
+  struct wheel *w = &wheels[t->cpu];
+  int pending;
+
+  acquire(&w->lock);
+  pending = t->pending;
+  if(pending)
+    timerunlink(w, t);
+  release(&w->lock);
+  return pending;
+}
+
+// Fire this cpu's timers that have expired by now.
+static void
+timertick(uint64 now)
+{
+  struct wheel *w = &wheels[cpuid()];
+  struct timer *t, *next;
+  uint64 s, last;
+
+  acquire(&w->lock);
+  last = now / SLOTNS;
+  if(last >= w->done + NSLOT)
+    w->done = last - NSLOT + 1;  // look at each list once
+  for(s = w->done; s <= last; s++){
+    for(t = w->slot[s % NSLOT]; t; t = next){
+      next = t->next;
+      if(t->expires <= now){
+        timerunlink(w, t);
+        wakeup(t->chan);
+      }
+    }
+  }
+  // Timers later in the last interval have yet to fire.
+  w->done = last;
+  release(&w->lock);
+}
+
+// Called by the clock interrupt on any cpu: bring ticks up
+// to date, fire expired timers, and program the next deadline.
+// Returns 1 if the running process's time slice is over, or
+// ready() has asked for it to be preempted.
+int
+clockintr(void)
+{
+  struct cpu *c = mycpu();
+  uint64 now;
+  int over;
+
+  now = nsnow();
+  acquire(&tickslock);
+  if(now / TICKNS > ticks)
+    ticks = now / TICKNS;
+  release(&tickslock);
+
+  timertick(now);
+
+  over = 0;
+  if(c->sliceend && now >= c->sliceend){
+    over = 1;
+    c->sliceend = now + TICKNS;  // in case it does not yield
+  }
+  if(c->resched){
+    over = 1;
+    c->resched = 0;
+  }
+  clockarm();
+  return over;
+}
@@ -0,0 +1,10 @@
+// Kernel timers, see timer.c.
+struct timer {
+  uint64 expires;       // time at which it goes off, in ns since boot
+  void *chan;           // wakeup(chan) when it does
+  int pending;          // Is it on a wheel?
+  int cpu;              // whose wheel it was added to
+  int slot;             // which wheel slot list it is on
+  struct timer *next;
+  struct timer *prev;
+};
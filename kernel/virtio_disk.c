@@ -166,10 +166,11 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
-// free a chain of descriptors.
+// free a chain of descriptors, and wake one process
+// waiting in virtio_disk_rw(), since a chain is enough
+// for one more request.
 static void
 free_chain(int i)
 {
@@ -182,6 +183,7 @@ free_chain(int i)
     else
       break;
   }
+  wakeupone(&disk.free[0]);
 }
 
 // allocate three descriptors (they need not be contiguous).
@@ -203,7 +205,7 @@ alloc3_desc(int *idx)
 void
 virtio_disk_rw(struct buf *b, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = (uint64)b->blockno * (b->size / 512);
 
   acquire(&disk.vdisk_lock);
 
@@ -238,7 +240,7 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].next = idx[1];
 
   disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+  disk.desc[idx[1]].len = b->size;
   if(write)
     disk.desc[idx[1]].flags = 0; // device reads b->data
   else
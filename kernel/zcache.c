@@ -0,0 +1,162 @@
+// Decompressed cluster cache.
+//
+// A compressed file (DI_COMPRESSED, see fs.h) is read a cluster
+// at a time: readi() calls zread(), which finds each cluster it
+// needs in the cache or reads its compressed bytes through the
+// buffer cache and decompresses them into the least recently
+// used entry. Sequential reads, exec() in particular, thus
+// decompress each cluster once.
+//
+// Compressed files are never written, so an entry stays valid
+// until the file is freed; iput() calls zpurge() then, so that
+// the inode number's next file cannot find the old entries.
+//
+// zcache.lock is a sleep-lock held for the whole of a zread(),
+// which protects the entries and the scratch buffer. Callers
+// hold the inode's lock, which is always taken first.
+//
+// Interface:
+// * zread() to read from a compressed file.
+// * zpurge() when a compressed file's inode is freed.
+
+#include "types.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "zcode.h"
+
+struct zentry {
+  uint dev;
+  uint inum;             // 0 if unused
+  uint cluster;
+  struct zentry *prev;   // LRU list
+  struct zentry *next;
+  uchar data[ZCLUSTER];
+};
+
+struct {
+  struct sleeplock lock;
+  struct zentry entry[NZCACHE];
+  uchar tmp[ZCLUSTER];   // compressed bytes of the cluster being read
+
+  // Linked list of all entries, through prev/next.
+  // head.next is most recent, head.prev is least.
+  struct zentry head;
+} zcache;
+
+void
+zinit(void)
+{
+  struct zentry *z;
+
+  initsleeplock(&zcache.lock, "zcache");
+  zcache.head.prev = &zcache.head;
+  zcache.head.next = &zcache.head;
+  for(z = zcache.entry; z < zcache.entry+NZCACHE; z++){
+    z->next = zcache.head.next;
+    z->prev = &zcache.head;
+    zcache.head.next->prev = z;
+    zcache.head.next = z;
+  }
+}
+
+// Move z to the head of the most-recently-used list.
+static void
+ztouch(struct zentry *z)
+{
+  z->next->prev = z->prev;
+  z->prev->next = z->next;
+  z->next = zcache.head.next;
+  z->prev = &zcache.head;
+  zcache.head.next->prev = z;
+  zcache.head.next = z;
+}
+
+// Return the entry holding cluster c of compressed file ip,
+// reading and decompressing it if necessary, or 0 if the
+// file is corrupt. Caller holds zcache.lock.
+static struct zentry*
+zget(struct inode *ip, uint c)
+{
+  struct zentry *z;
+  uint off[2], len, ulen;
+
+  for(z = zcache.head.next; z != &zcache.head; z = z->next){
+    if(z->dev == ip->dev && z->inum == ip->inum && z->cluster == c){
+      ztouch(z);
+      return z;
+    }
+  }
+
+  z = zcache.head.prev;
+  z->inum = 0;
+  ulen = ip->size - c*ZCLUSTER;
+  if(ulen > ZCLUSTER)
+    ulen = ZCLUSTER;
+  if(readstream(ip, (char*)off, c*sizeof(uint), sizeof(off)) != sizeof(off))
+    goto bad;
+  if(off[1] < off[0] || (len = off[1] - off[0]) > ulen)
+    goto bad;
+  if(len == ulen){
+    // stored as is
+    if(readstream(ip, (char*)z->data, off[0], len) != len)
+      goto bad;
+  } else {
+    if(readstream(ip, (char*)zcache.tmp, off[0], len) != len ||
+       zdecode(zcache.tmp, len, z->data, ulen) != ulen)
+      goto bad;
+  }
+  z->dev = ip->dev;
+  z->inum = ip->inum;
+  z->cluster = c;
+  ztouch(z);
+  return z;
+
+bad:
+  printf("zread: inode %d cluster %d is corrupt\n", ip->inum, c);
+  return 0;
+}
+
+// Read n bytes at offset off of compressed file ip, which
+// the caller has checked lie within the file.
+// Caller must hold ip->lock.
+int
+zread(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  struct zentry *z;
+  uint tot, m;
+
+  acquiresleep(&zcache.lock);
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = n - tot;
+    if(m > ZCLUSTER - off%ZCLUSTER)
+      m = ZCLUSTER - off%ZCLUSTER;
+    if((z = zget(ip, off/ZCLUSTER)) == 0 ||
+       either_copyout(user_dst, dst, z->data + off%ZCLUSTER, m) == -1){
+      tot = -1;
+      break;
+    }
+  }
+  releasesleep(&zcache.lock);
+  return tot;
+}
+
+// Forget the clusters of compressed file inum, whose inode
+// is being freed.
+void
+zpurge(uint dev, uint inum)
+{
+  struct zentry *z;
+
+  acquiresleep(&zcache.lock);
+  for(z = zcache.entry; z < zcache.entry+NZCACHE; z++){
+    if(z->dev == dev && z->inum == inum)
+      z->inum = 0;
+  }
+  releasesleep(&zcache.lock);
+}
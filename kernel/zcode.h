@@ -0,0 +1,60 @@
+// Decompression of the clusters of compressed files (see fs.h),
+// shared by the kernel and by mkfs, which decodes each cluster
+// it compresses to check that the kernel will read it back.
+// Includers must declare memmove().
+
+// Read a length continued in bytes of 255 (see fs.h) from
+// *sp, adding it to *np. Returns -1 if it runs past e.
+static inline int
+zlen(uchar **sp, uchar *e, int *np)
+{
+  uchar *s = *sp;
+
+  do {
+    if(s >= e)
+      return -1;
+    *np += *s;
+  } while(*s++ == 255);
+  *sp = s;
+  return 0;
+}
+
+// Decompress the n bytes at src into dst, which has room for
+// max bytes. Returns the number of bytes decompressed, or -1
+// if src is not a well-formed compressed cluster.
+static inline int
+zdecode(uchar *src, int n, uchar *dst, int max)
+{
+  uchar *s, *e;
+  int o, t, lit, len, dist;
+
+  s = src;
+  e = src + n;
+  o = 0;
+  while(s < e){
+    t = *s++;
+    lit = t >> 4;
+    if(lit == 15 && zlen(&s, e, &lit) < 0)
+      return -1;
+    if(lit > e - s || lit > max - o)
+      return -1;
+    memmove(dst + o, s, lit);
+    s += lit;
+    o += lit;
+    if(s == e)
+      break;  // the last sequence has no match
+
+    if(e - s < 2)
+      return -1;
+    dist = s[0] | (s[1] << 8);
+    s += 2;
+    len = (t & 15) + ZMINMATCH;
+    if((t & 15) == 15 && zlen(&s, e, &len) < 0)
+      return -1;
+    if(dist == 0 || dist > o || len > max - o)
+      return -1;
+    for(; len > 0; len--, o++)
+      dst[o] = dst[o - dist];  // may overlap, so byte by byte
+  }
+  return o;
+}
@@ -4,43 +4,91 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Name of the next entry in host directory d, or 0 at the end.
+// Defined before struct dirent comes to mean the xv6 one.
+static char*
+hostreaddir(DIR *d)
+{
+  struct dirent *e = readdir(d);
+
+  return e ? e->d_name : 0;
+}
 
 #define stat xv6_stat  // avoid clash with host struct stat
+#define dirent xv6_dirent  // and with host struct dirent
 #include "kernel/types.h"
 #include "kernel/fs.h"
 #include "kernel/stat.h"
 #include "kernel/param.h"
+#include "kernel/zcode.h"
+#undef stat
 
 #ifndef static_assert
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
 #define NINODES 200
+#define MAXINODES 65536  // dirent inums are 16 bits
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
+// [ boot block | sb block | log | inode blocks | inode bit map | free bit map | refcounts | data blocks ]
+// With 4096-byte blocks, the boot block and sb share block 0.
+
+uint bsize = BSIZE;
+uint fssize = FSSIZE;
+uint ninodes = NINODES;
+int nbitmap;
+int nrefblocks;
+int ninodeblocks;
+int ninodemap;
 int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nsb;      // Number of blocks holding boot block and sb
+int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, inode map, bitmap, refcounts)
 int nblocks;  // Number of data blocks
+uint sbflags;  // Super block flags (FS_ORDERED)
 
 int fsfd;
+char *img;    // The image, mapped into memory
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+uint nfiles;  // Number of files and directories added
+int zflag;    // Compress files (-z)
+uint zfiles;  // Number of files compressed
+uint zin, zout;  // Blocks of files considered for compression, before and after
+
+// With -D, identical data blocks are stored once. dtab is an
+// open-addressed hash table of the data blocks written so far,
+// with the file each first belonged to.
+struct dedup {
+  uint b;     // block number, or 0
+  uint inum;
+} *dtab;
+uint ndtab;   // size of dtab, a power of 2
+uint dshared, dholes;  // blocks saved by sharing, and as holes
 
 
 void balloc(int);
+void iballoc(int);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
+uint newblocks(uint n);
 void iappend(uint inum, void *p, int n);
+void wfile(uint inum, int fd, char *name);
+uint nblks(uint n);
+void adddir(uint dirino, struct dirent **ents, int *n, char *path);
+void dirappend(struct dirent **ents, int *n, uint inum, char *name);
+void wdir(uint inum, struct dirent *ents, int n);
 void die(const char *);
+void usage(void);
 
 // convert to intel byte order
 ushort
@@ -68,64 +116,115 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
-  char buf[BSIZE];
-  struct dinode din;
+  int i, fd, nroot;
+  uint rootino, inum;
+  struct dirent *rootents;
+  char buf[MAXBSIZE];
+  char *hostdir = 0;
+  struct timespec t0, t1;
+  double secs;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  while((i = getopt(argc, argv, "b:s:i:l:od:zD")) != -1){
+    switch(i){
+    case 'b': bsize = atoi(optarg); break;
+    case 's': fssize = atoi(optarg); break;
+    case 'i': ninodes = atoi(optarg); break;
+    case 'l': nlog = atoi(optarg); break;
+    case 'o': sbflags |= FS_ORDERED; break;
+    case 'd': hostdir = optarg; break;
+    case 'z': zflag = 1; break;
+    case 'D': sbflags |= FS_DEDUP; break;
+    default: usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if(argc < 2 || (bsize != BSIZE && bsize != MAXBSIZE))
+    usage();
+  if(ninodes < 2 || ninodes > MAXINODES){
+    fprintf(stderr, "mkfs: inodes must be between 2 and %d\n", MAXINODES);
+    exit(1);
+  }
+  if(nlog <= MAXOPBLOCKS || nlog > bsize/sizeof(int)){
+    fprintf(stderr, "mkfs: log blocks must be between %d and %d\n",
+            MAXOPBLOCKS+1, (int)(bsize/sizeof(int)));
     exit(1);
   }
 
-  assert((BSIZE % sizeof(struct dinode)) == 0);
-  assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert((bsize % sizeof(struct dinode)) == 0);
+  assert((bsize % sizeof(struct dirent)) == 0);
+  assert(SBOFF + sizeof(sb) <= 2 * BSIZE);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
     die(argv[1]);
 
-  // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  sb.bsize = xint(bsize);
+  nsb = (SBOFF + sizeof(sb) + bsize - 1) / bsize;
+  nbitmap = fssize/(bsize*8) + 1;
+  ninodeblocks = ninodes / IPB(sb) + 1;
+  ninodemap = ninodes/(bsize*8) + 1;
+  nrefblocks = fssize/bsize + 1;
+
+  nmeta = nsb + nlog + ninodeblocks + ninodemap + nbitmap + nrefblocks;
+  if(fssize <= nmeta){
+    fprintf(stderr, "mkfs: %u blocks is too small\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.logstart = xint(nsb);
+  sb.inodestart = xint(nsb+nlog);
+  sb.imapstart = xint(nsb+nlog+ninodeblocks);
+  sb.bmapstart = xint(nsb+nlog+ninodeblocks+ninodemap);
+  sb.refstart = xint(nsb+nlog+ninodeblocks+ninodemap+nbitmap);
+  sb.flags = xint(sbflags);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("block size %u, nmeta %d (boot, super, log blocks %u inode blocks %u, inode map blocks %u, bitmap blocks %u, refcount blocks %u) blocks %d total %d\n",
+         bsize, nmeta, nlog, ninodeblocks, ninodemap, nbitmap, nrefblocks, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  if(sbflags & FS_DEDUP){
+    for(ndtab = 1; ndtab < 2 * fssize; ndtab *= 2)
+      ;
+    if((dtab = calloc(ndtab, sizeof(*dtab))) == 0)
+      die("calloc");
+  }
+
+  // Extending the file reads back as zeroes, without writing
+  // every block of a large image.
+  if(ftruncate(fsfd, (off_t)fssize * bsize) < 0)
+    die("ftruncate");
+
+  // Build the image in memory, so that each block written costs
+  // a memory copy rather than a system call; the kernel writes
+  // the dirty pages back in large batches.
+  img = mmap(0, (size_t)fssize * bsize, PROT_READ|PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(img == MAP_FAILED)
+    die("mmap");
 
   memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  memmove(buf + SBOFF % bsize, &sb, sizeof(sb));
+  wsect(SBOFF / bsize, buf);
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootents = 0;
+  nroot = 0;
+  dirappend(&rootents, &nroot, rootino, ".");
+  dirappend(&rootents, &nroot, rootino, "..");
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -149,25 +248,38 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirappend(&rootents, &nroot, inum, shortname);
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
+    wfile(inum, fd, argv[i]);
 
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(hostdir)
+    adddir(rootino, &rootents, &nroot, hostdir);
+
+  wdir(rootino, rootents, nroot);
+  free(rootents);
 
   balloc(freeblock);
+  iballoc(freeinode);
+
+  if(munmap(img, (size_t)fssize * bsize) < 0)
+    die("munmap");
+  if(close(fsfd) < 0)
+    die("close");
+
+  if(zflag)
+    printf("mkfs: compressed %u files, %u blocks to %u\n", zfiles, zin, zout);
+  if(dtab)
+    printf("mkfs: dedup saved %u blocks (%u KB): %u shared, %u zero\n",
+           dshared + dholes, (dshared + dholes) * (bsize / 1024), dshared, dholes);
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("mkfs: %u files, %u of %u blocks used, in %.3f s (%.1f MB/s)\n",
+         nfiles, freeblock, fssize, secs,
+         secs > 0 ? (double)freeblock * bsize / secs / (1024*1024) : 0.0);
 
   exit(0);
 }
@@ -175,22 +287,20 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
-    die("write");
+  assert(sec < fssize);
+  memmove(img + (size_t)sec * bsize, buf, bsize);
 }
 
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   uint bn;
   struct dinode *dip;
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
+  dip = ((struct dinode*)buf) + (inum % IPB(sb));
   *dip = *ip;
   wsect(bn, buf);
 }
@@ -198,23 +308,21 @@ winode(uint inum, struct dinode *ip)
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
+  char buf[MAXBSIZE];
   uint bn;
   struct dinode *dip;
 
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
+  dip = ((struct dinode*)buf) + (inum % IPB(sb));
   *ip = *dip;
 }
 
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
-    die("read");
+  assert(sec < fssize);
+  memmove(buf, img + (size_t)sec * bsize, bsize);
 }
 
 uint
@@ -223,28 +331,71 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes\n");
+    exit(1);
+  }
+  nfiles++;
+
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  if(type == T_FILE)
+    din.flags = xshort(DI_INLINE);
   winode(inum, &din);
   return inum;
 }
 
+// Allocate n consecutive data blocks, returning the first.
+uint
+newblocks(uint n)
+{
+  uint b = freeblock;
+
+  if(n > fssize - freeblock){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
+  }
+  freeblock += n;
+  return b;
+}
+
+// Set bits 0 through used-1 of the bitmap starting at block start.
 void
-balloc(int used)
+wbitmap(uint start, int used)
 {
-  uchar buf[BSIZE];
-  int i;
+  uchar buf[MAXBSIZE];
+  int i, b;
 
+  for(b = 0; b * bsize * 8 < used; b++){
+    bzero(buf, bsize);
+    for(i = 0; i < bsize*8 && b*bsize*8 + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    wsect(start + b, buf);
+  }
+}
+
+void
+balloc(int used)
+{
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  if(used > fssize){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
   }
   printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  wbitmap(sb.bmapstart, used);
+}
+
+// Mark inodes 0 through used-1 allocated in the inode map.
+// Inode 0 is never handed out, so its bit is always set.
+void
+iballoc(int used)
+{
+  printf("iballoc: first %d inodes have been allocated\n", used);
+  wbitmap(sb.imapstart, used);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -255,35 +406,52 @@ iappend(uint inum, void *xp, int n)
   char *p = (char*)xp;
   uint fbn, off, n1;
   struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  char buf[MAXBSIZE];
+  uint indirect[MAXBSIZE / sizeof(uint)];
   uint x;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  if(xshort(din.flags) & DI_INLINE){
+    if(off + n <= NINLINE){
+      bcopy(p, (char*)din.addrs + off, n);
+      din.size = xint(off + n);
+      winode(inum, &din);
+      return;
+    }
+    // Too big to stay inline: move the data to blocks.
+    bcopy(din.addrs, buf, off);
+    bzero(din.addrs, sizeof(din.addrs));
+    din.flags = xshort(xshort(din.flags) & ~DI_INLINE);
+    din.size = xint(0);
+    winode(inum, &din);
+    if(off > 0)
+      iappend(inum, buf, off);
+    rinode(inum, &din);
+  }
   while(n > 0){
-    fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
+    fbn = off / bsize;
+    assert(fbn < MAXFILE(sb));
     if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+        din.addrs[fbn] = xint(newblocks(1));
       }
       x = xint(din.addrs[fbn]);
     } else {
       if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+        din.addrs[NDIRECT] = xint(newblocks(1));
       }
       rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
+        indirect[fbn - NDIRECT] = xint(newblocks(1));
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
     }
-    n1 = min(n, (fbn + 1) * BSIZE - off);
+    n1 = min(n, (fbn + 1) * bsize - off);
     rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
+    bcopy(p, buf + off - (fbn * bsize), n1);
     wsect(x, buf);
     n -= n1;
     off += n1;
@@ -293,6 +461,424 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Return the number of blocks n bytes occupy.
+uint
+nblks(uint n)
+{
+  return (n + bsize - 1) / bsize;
+}
+
+// FNV-1a hash of a block's data, with a final mix so that
+// its low bits, which index the table, depend on all of it.
+uint
+bhash(char *p)
+{
+  uint h = 2166136261U;
+  int i;
+
+  for(i = 0; i < bsize; i++)
+    h = (h ^ (uchar)p[i]) * 16777619U;
+  h = (h ^ (h >> 16)) * 0x85ebca6bU;
+  h = (h ^ (h >> 13)) * 0xc2b2ae35U;
+  return h ^ (h >> 16);
+}
+
+// Return the block that a data block of file inum, whose inode
+// is din, holding the bsize bytes at p should be stored in: 0, a
+// hole, if they are all zero; an earlier block holding the same
+// data, which both files then share; or a new block.
+uint
+dedupblock(uint inum, struct dinode *din, char *p)
+{
+  struct dedup *d;
+  struct dinode odin;
+  uchar *r;
+  uint i, b;
+
+  for(i = 0; i < bsize && p[i] == 0; i++)
+    ;
+  if(i == bsize){
+    dholes++;
+    return 0;
+  }
+  for(i = bhash(p) & (ndtab - 1); dtab[i].b; i = (i + 1) & (ndtab - 1)){
+    d = &dtab[i];
+    r = (uchar*)img + (size_t)xint(sb.refstart) * bsize + d->b;
+    if(memcmp(img + (size_t)d->b * bsize, p, bsize) != 0 || *r == MAXREF)
+      continue;
+    (*r)++;
+    din->flags = xshort(xshort(din->flags) | DI_SHARED);
+    if(d->inum != inum){
+      rinode(d->inum, &odin);
+      odin.flags = xshort(xshort(odin.flags) | DI_SHARED);
+      winode(d->inum, &odin);
+    }
+    dshared++;
+    return d->b;
+  }
+  b = newblocks(1);
+  memmove(img + (size_t)b * bsize, p, bsize);
+  dtab[i].b = b;
+  dtab[i].inum = inum;
+  return b;
+}
+
+// Store the n bytes at p as the data of inode din, number inum,
+// in consecutive blocks followed by its indirect block if it
+// needs one. With -D, blocks already in the image are shared.
+void
+wblocks(uint inum, struct dinode *din, char *p, uint n)
+{
+  char buf[MAXBSIZE];
+  uint *indirect, *a;
+  uint nb, first, i, m;
+
+  nb = nblks(n);
+  if((a = calloc(nb, sizeof(uint))) == 0)
+    die("calloc");
+  if(dtab){
+    for(i = 0; i < nb; i++){
+      m = min(bsize, n - i*bsize);
+      memmove(buf, p + i*bsize, m);
+      bzero(buf + m, bsize - m);
+      a[i] = dedupblock(inum, din, buf);
+    }
+  } else {
+    first = newblocks(nb);
+    for(i = 0; i < nb; i++)
+      a[i] = first + i;
+    memmove(img + (size_t)first * bsize, p, n);
+  }
+
+  indirect = 0;
+  if(nb > NDIRECT){
+    din->addrs[NDIRECT] = xint(newblocks(1));
+    indirect = (uint*)(img + (size_t)xint(din->addrs[NDIRECT]) * bsize);
+  }
+  for(i = 0; i < nb; i++){
+    if(i < NDIRECT)
+      din->addrs[i] = xint(a[i]);
+    else
+      indirect[i - NDIRECT] = xint(a[i]);
+  }
+  free(a);
+}
+
+// Append length n to a sequence at d, in bytes of 255 (see fs.h).
+uchar*
+zputlen(uchar *d, int n)
+{
+  while(n >= 255){
+    *d++ = 255;
+    n -= 255;
+  }
+  *d++ = n;
+  return d;
+}
+
+#define ZHASH 4096
+
+// Compress the n bytes at src into dst, which has room for
+// 2*n+16 bytes, in the format described in fs.h. Returns the
+// compressed length, or n if compressing would not save space.
+int
+zencode(uchar *src, int n, uchar *dst)
+{
+  int table[ZHASH];  // last position of each hash of ZMINMATCH bytes
+  int i, anchor, cand, lit, len;
+  uchar *d, *tok;
+  uint h;
+
+  memset(table, 0xff, sizeof(table));
+  d = dst;
+  anchor = 0;
+  for(i = 0; i + ZMINMATCH <= n; ){
+    h = (src[i] | src[i+1] << 8 | src[i+2] << 16 | (uint)src[i+3] << 24);
+    h = (h * 2654435761U) >> 20;
+    cand = table[h];
+    table[h] = i;
+    if(cand < 0 || i - cand > 0xffff || memcmp(src + cand, src + i, ZMINMATCH) != 0){
+      i++;
+      continue;
+    }
+    len = ZMINMATCH;
+    while(i + len < n && src[cand + len] == src[i + len])
+      len++;
+
+    lit = i - anchor;
+    tok = d++;
+    *tok = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15)
+      d = zputlen(d, lit - 15);
+    memmove(d, src + anchor, lit);
+    d += lit;
+    *d++ = i - cand;
+    *d++ = (i - cand) >> 8;
+    *tok |= len - ZMINMATCH < 15 ? len - ZMINMATCH : 15;
+    if(len - ZMINMATCH >= 15)
+      d = zputlen(d, len - ZMINMATCH - 15);
+    i += len;
+    anchor = i;
+    if(d - dst >= n)
+      return n;
+  }
+  if(anchor < n){
+    lit = n - anchor;
+    *d++ = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15)
+      d = zputlen(d, lit - 15);
+    memmove(d, src + anchor, lit);
+    d += lit;
+  }
+  if(d - dst >= n)
+    return n;
+  return d - dst;
+}
+
+// Compress the n bytes at p into a stream as described in fs.h.
+// Each compressed cluster is decoded as the kernel will, and
+// must give back what was compressed. Returns the stream, which
+// the caller must free, and sets *sn to its length.
+char*
+zstream(char *p, uint n, uint *sn)
+{
+  static uchar zbuf[2*ZCLUSTER+16], check[ZCLUSTER];
+  uint ncl, c, o, len, clen;
+  uint *index;
+  char *s;
+
+  ncl = (n + ZCLUSTER - 1) / ZCLUSTER;
+  o = (ncl + 1) * sizeof(uint);
+  if((s = malloc(o + n)) == 0)
+    die("malloc");
+  index = (uint*)s;
+  for(c = 0; c < ncl; c++){
+    index[c] = xint(o);
+    len = min(ZCLUSTER, n - c*ZCLUSTER);
+    clen = zencode((uchar*)p + c*ZCLUSTER, len, zbuf);
+    if(clen < len){
+      if(zdecode(zbuf, clen, check, len) != len ||
+         memcmp(check, p + c*ZCLUSTER, len) != 0){
+        fprintf(stderr, "mkfs: cluster %u does not decompress\n", c);
+        exit(1);
+      }
+      memmove(s + o, zbuf, clen);
+    } else
+      memmove(s + o, p + c*ZCLUSTER, len);  // store it as is
+    o += clen;
+  }
+  index[ncl] = xint(o);
+  *sn = o;
+  return s;
+}
+
+// Write the contents of host file fd, called name, to the empty
+// file inum. Its data blocks are consecutive, followed by its
+// indirect block if it needs one. With -z, the file is stored
+// compressed if that takes fewer blocks.
+void
+wfile(uint inum, int fd, char *name)
+{
+  struct stat st;
+  struct dinode din;
+  char *data, *z;
+  uint size, i, zn;
+  ssize_t cc;
+
+  if(fstat(fd, &st) < 0)
+    die(name);
+  if(st.st_size > (off_t)MAXFILE(sb) * bsize){
+    fprintf(stderr, "mkfs: %s: too big\n", name);
+    exit(1);
+  }
+  if((data = malloc(st.st_size + 1)) == 0)
+    die("malloc");
+  for(i = 0; i < st.st_size; i += cc){
+    if((cc = read(fd, data + i, st.st_size - i)) < 0)
+      die(name);
+    if(cc == 0)
+      break;  // file shrank while we were reading it
+  }
+  size = i;
+
+  if(size <= NINLINE){
+    iappend(inum, data, size);
+    free(data);
+    return;
+  }
+
+  rinode(inum, &din);
+  bzero(din.addrs, sizeof(din.addrs));
+  din.flags = xshort(xshort(din.flags) & ~DI_INLINE);
+  din.size = xint(size);
+  z = 0;
+  if(zflag){
+    z = zstream(data, size, &zn);
+    zin += nblks(size);
+    if(nblks(zn) < nblks(size)){
+      din.flags = xshort(xshort(din.flags) | DI_COMPRESSED);
+      wblocks(inum, &din, z, zn);
+      zout += nblks(zn);
+      zfiles++;
+    } else {
+      free(z);
+      z = 0;
+      zout += nblks(size);
+    }
+  }
+  if(z == 0)
+    wblocks(inum, &din, data, size);
+  winode(inum, &din);
+  free(z);
+  free(data);
+}
+
+// Add the files and directories under host directory path to
+// directory dirino, whose entries so far are ents, recursively.
+void
+adddir(uint dirino, struct dirent **ents, int *n, char *path)
+{
+  DIR *d;
+  char *name, *sub;
+  struct stat st;
+  struct dinode din;
+  struct dirent *subents;
+  int fd, nsub;
+  uint inum;
+
+  if((d = opendir(path)) == 0)
+    die(path);
+  while((name = hostreaddir(d)) != 0){
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    if(strlen(name) > DIRSIZ){
+      fprintf(stderr, "mkfs: %s/%s: name too long, skipped\n", path, name);
+      continue;
+    }
+    if((sub = malloc(strlen(path) + strlen(name) + 2)) == 0)
+      die("malloc");
+    sprintf(sub, "%s/%s", path, name);
+    if(stat(sub, &st) < 0)
+      die(sub);
+    if(S_ISDIR(st.st_mode)){
+      inum = ialloc(T_DIR);
+      dirappend(ents, n, inum, name);
+      subents = 0;
+      nsub = 0;
+      dirappend(&subents, &nsub, inum, ".");
+      dirappend(&subents, &nsub, dirino, "..");
+      adddir(inum, &subents, &nsub, sub);
+      wdir(inum, subents, nsub);
+      free(subents);
+      rinode(dirino, &din);  // for ".."
+      din.nlink = xshort(xshort(din.nlink) + 1);
+      winode(dirino, &din);
+    } else if(S_ISREG(st.st_mode)){
+      if((fd = open(sub, O_RDONLY)) < 0)
+        die(sub);
+      inum = ialloc(T_FILE);
+      dirappend(ents, n, inum, name);
+      wfile(inum, fd, sub);
+      close(fd);
+    } else {
+      fprintf(stderr, "mkfs: %s: not a file or directory, skipped\n", sub);
+    }
+    free(sub);
+  }
+  closedir(d);
+}
+
+// Add an entry for name to a growing array of directory entries.
+void
+dirappend(struct dirent **ents, int *n, uint inum, char *name)
+{
+  struct dirent *de;
+
+  if((*ents = realloc(*ents, (*n + 1) * sizeof(**ents))) == 0)
+    die("realloc");
+  de = &(*ents)[(*n)++];
+  bzero(de, sizeof(*de));
+  de->inum = xshort(inum);
+  strncpy(de->name, name, DIRSIZ);
+}
+
+// Write the entries of the empty directory inum, as a single
+// linear block if they fit and as an indexed directory if not.
+void
+wdir(uint inum, struct dirent *ents, int n)
+{
+  struct dinode din;
+  struct dirindex *ix;
+  struct dirmap *map;
+  struct dirnext *nx;
+  struct dirent *de;
+  char *blocks;
+  uint nbucket, nblk, blk, b;
+  int i;
+
+  if(n <= DPB(sb)){
+    iappend(inum, ents, n * sizeof(*ents));
+    // fix size of inode dir
+    rinode(inum, &din);
+    din.size = xint(bsize);
+    winode(inum, &din);
+    return;
+  }
+
+  nbucket = 2;
+  while(nbucket * DIRSPLIT(sb) < n && nbucket < MAXBUCKET(sb))
+    nbucket++;
+
+  // Block 0 is the index, blocks 1..nbucket start the buckets,
+  // and overflow blocks follow.
+  nblk = 1 + nbucket;
+  if((blocks = calloc(nblk, bsize)) == 0)
+    die("calloc");
+  ix = (struct dirindex*)blocks;
+  ix->magic = xshort(DIRINDEX);
+  ix->nbucket = xint(nbucket);
+  ix->nentry = xint(n);
+  for(b = 0; b < nbucket; b++){
+    map = (struct dirmap*)(blocks + sizeof(*ix)) + b/DIRMAPN;
+    map->bucket[b % DIRMAPN] = xint(1 + b);
+    nx = (struct dirnext*)(blocks + (1 + b) * bsize);
+    nx->magic = xshort(DIRBUCKET);
+  }
+
+  for(i = 0; i < n; i++){
+    blk = 1 + dirbucket(dirhash(ents[i].name), nbucket);
+    for(;;){
+      for(de = (struct dirent*)(blocks + blk*bsize) + 1; de < (struct dirent*)(blocks + (blk+1)*bsize); de++){
+        if(de->inum == 0)
+          goto found;
+      }
+      nx = (struct dirnext*)(blocks + blk*bsize);
+      if(xint(nx->next) == 0){
+        // Chain is full: link in a new block.
+        if((blocks = realloc(blocks, (nblk + 1) * bsize)) == 0)
+          die("realloc");
+        bzero(blocks + nblk*bsize, bsize);
+        ((struct dirnext*)(blocks + blk*bsize))->next = xint(nblk);
+        ((struct dirnext*)(blocks + nblk*bsize))->magic = xshort(DIRBUCKET);
+        nblk++;
+      }
+      blk = xint(((struct dirnext*)(blocks + blk*bsize))->next);
+    }
+  found:
+    *de = ents[i];
+  }
+
+  iappend(inum, blocks, nblk * bsize);
+  free(blocks);
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: mkfs [-b 1024|4096] [-s blocks] [-i inodes] [-l logblocks] [-o] [-z] [-D] [-d dir] fs.img files...\n");
+  exit(1);
+}
+
 void
 die(const char *s)
 {
@@ -0,0 +1,138 @@
+// Stress test for large file system images: fill many
+// directories with many files, check their contents, and
+// remove them. Build the image with, e.g.,
+//   make FSBSIZE=4096 FSSIZE=1000000 FSINODES=60000 FSLOG=500 qemu
+// and run "bigfs 2000 20000".
+//
+// usage: bigfs [mbytes [nfiles]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+#define NPERDIR 500
+
+char buf[4096];
+
+void
+mkpath(char *p, int i)
+{
+  char *s;
+  int d, n;
+
+  s = p;
+  *s++ = 'b';
+  *s++ = 'f';
+  *s++ = '/';
+  *s++ = 'd';
+  d = i / NPERDIR;
+  for(n = 1000; n > 0; n /= 10)
+    *s++ = '0' + (d / n) % 10;
+  *s++ = '/';
+  *s++ = 'f';
+  for(n = 10000; n > 0; n /= 10)
+    *s++ = '0' + (i / n) % 10;
+  *s = '\0';
+}
+
+void
+fill(int i, int j)
+{
+  int k;
+
+  for(k = 0; k < sizeof(buf)/sizeof(int); k++)
+    ((int*)buf)[k] = i * 7919 + j * 31 + k;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, k, mb, nfiles, nchunk, fd, t0;
+  char path[32];
+
+  mb = 16;
+  nfiles = 1000;
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(argc > 2)
+    nfiles = atoi(argv[2]);
+  nchunk = mb * 256 / nfiles;
+  if(mb < 1 || nfiles < 1 || nfiles > 99999 || nchunk < 1){
+    fprintf(2, "usage: bigfs [mbytes [nfiles]], with at least 4 KB per file\n");
+    exit(1);
+  }
+
+  if(mkdir("bf") < 0){
+    fprintf(2, "bigfs: cannot make bf\n");
+    exit(1);
+  }
+
+  t0 = uptime();
+  for(i = 0; i < nfiles; i++){
+    mkpath(path, i);
+    if(i % NPERDIR == 0){
+      path[8] = '\0';
+      if(mkdir(path) < 0){
+        fprintf(2, "bigfs: mkdir %s failed\n", path);
+        exit(1);
+      }
+      mkpath(path, i);
+    }
+    if((fd = open(path, O_CREATE|O_WRONLY)) < 0){
+      fprintf(2, "bigfs: create %s failed\n", path);
+      exit(1);
+    }
+    for(j = 0; j < nchunk; j++){
+      fill(i, j);
+      if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+        fprintf(2, "bigfs: write %s failed at %d KB\n", path, j * 4);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  printf("wrote %d files, %d KB each: %d ticks\n", nfiles, nchunk * 4, uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < nfiles; i++){
+    mkpath(path, i);
+    if((fd = open(path, O_RDONLY)) < 0){
+      fprintf(2, "bigfs: open %s failed\n", path);
+      exit(1);
+    }
+    for(j = 0; j < nchunk; j++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+        fprintf(2, "bigfs: read %s failed at %d KB\n", path, j * 4);
+        exit(1);
+      }
+      for(k = 0; k < sizeof(buf)/sizeof(int); k++){
+        if(((int*)buf)[k] != i * 7919 + j * 31 + k){
+          fprintf(2, "bigfs: %s has wrong data at %d KB\n", path, j * 4);
+          exit(1);
+        }
+      }
+    }
+    close(fd);
+  }
+  printf("verified: %d ticks\n", uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < nfiles; i++){
+    mkpath(path, i);
+    if(unlink(path) < 0){
+      fprintf(2, "bigfs: unlink %s failed\n", path);
+      exit(1);
+    }
+    if(i % NPERDIR == NPERDIR - 1 || i == nfiles - 1){
+      path[8] = '\0';
+      if(unlink(path) < 0){
+        fprintf(2, "bigfs: unlink %s failed\n", path);
+        exit(1);
+      }
+    }
+  }
+  unlink("bf");
+  printf("removed: %d ticks\n", uptime() - t0);
+  exit(0);
+}
@@ -0,0 +1,45 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+char buf[512];
+
+int
+main(int argc, char *argv[])
+{
+  int in, out, n;
+
+  if(argc != 3){
+    fprintf(2, "Usage: cp src dst\n");
+    exit(1);
+  }
+  if((in = open(argv[1], O_RDONLY)) < 0){
+    fprintf(2, "cp: cannot open %s\n", argv[1]);
+    exit(1);
+  }
+  if((out = open(argv[2], O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    fprintf(2, "cp: cannot create %s\n", argv[2]);
+    exit(1);
+  }
+
+  // Let the file system share the blocks if it can;
+  // otherwise copy through buf.
+  while((n = copy_file_range(in, out, 1 << 20)) > 0)
+    ;
+  if(n < 0){
+    while((n = read(in, buf, sizeof(buf))) > 0){
+      if(write(out, buf, n) != n){
+        fprintf(2, "cp: write error\n");
+        exit(1);
+      }
+    }
+    if(n < 0){
+      fprintf(2, "cp: read error\n");
+      exit(1);
+    }
+  }
+  close(in);
+  close(out);
+  exit(0);
+}
@@ -0,0 +1,93 @@
+// Time creating, looking up, and removing many names in one
+// directory, which exercises hash-indexed directories.
+//
+// usage: dirbench [n]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+void
+mkname(char *name, int i)
+{
+  name[0] = 'n';
+  name[1] = '0' + (i / 1000) % 10;
+  name[2] = '0' + (i / 100) % 10;
+  name[3] = '0' + (i / 10) % 10;
+  name[4] = '0' + i % 10;
+  name[5] = '\0';
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, fd, t0;
+  char name[8];
+
+  n = 1000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1 || n > 10000){
+    fprintf(2, "usage: dirbench [n], 1 <= n <= 10000\n");
+    exit(1);
+  }
+
+  if(mkdir("dirbench.d") < 0 || chdir("dirbench.d") < 0){
+    fprintf(2, "dirbench: cannot make dirbench.d\n");
+    exit(1);
+  }
+  if((fd = open("target", O_CREATE|O_RDWR)) < 0){
+    fprintf(2, "dirbench: cannot create target\n");
+    exit(1);
+  }
+  close(fd);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    if(link("target", name) < 0){
+      fprintf(2, "dirbench: link %s failed\n", name);
+      exit(1);
+    }
+  }
+  printf("create %d names: %d ticks\n", n, uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    if((fd = open(name, O_RDONLY)) < 0){
+      fprintf(2, "dirbench: open %s failed\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+  printf("look up %d names: %d ticks\n", n, uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    name[0] = 'm';
+    if(open(name, O_RDONLY) >= 0){
+      fprintf(2, "dirbench: open %s succeeded\n", name);
+      exit(1);
+    }
+  }
+  printf("look up %d missing names: %d ticks\n", n, uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    if(unlink(name) < 0){
+      fprintf(2, "dirbench: unlink %s failed\n", name);
+      exit(1);
+    }
+  }
+  printf("remove %d names: %d ticks\n", n, uptime() - t0);
+
+  unlink("target");
+  chdir("..");
+  unlink("dirbench.d");
+  exit(0);
+}
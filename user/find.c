@@ -27,8 +27,8 @@ char *basename(char *pathname)
 void find(char *curr_path, char *target)
 {
     char buf[512], *p;
-    int fd;
-    struct dirent de;
+    int fd, i, n;
+    struct dirstat ds[8]; // small: find recurses on a one-page stack
     struct stat st;
 
     if ((fd = open(curr_path, O_RDONLY)) < 0) {
@@ -64,15 +64,21 @@ void find(char *curr_path, char *target)
         buf[curr_path_len] = '/';//prepare to append the next level directory/filename
         p = buf + curr_path_len + 1;// pointer to the next character to be written in buf
         //Directories are implemented as a special type of file.
-        // These directory files contain a set of "directory entries," each of which points to a file or subdirectory in the filesystem.
-        while (read(fd, &de, sizeof(de)) == sizeof(de)) { //loop continues until the read function is unable to read a complete entry
-                if (de.inum == 0 || strcmp(de.name, ".") == 0 || strcmp(de.name, "..") == 0) {
+        // getdents returns a batch of entries along with each one's type,
+        // so only subdirectories need to be opened.
+        while ((n = getdents(fd, ds, sizeof(ds)/sizeof(ds[0]), GD_STAT)) > 0) {
+            for (i = 0; i < n; i++) {
+                if (strcmp(ds[i].name, ".") == 0 || strcmp(ds[i].name, "..") == 0) {
                     continue;
-                }   
-                memcpy(p, de.name, DIRSIZ);
-                p[DIRSIZ] = 0;
-                find(buf, target);
-        } 
+                }
+                strcpy(p, ds[i].name);
+                if (ds[i].type == T_DIR) {
+                    find(buf, target);
+                } else if (ds[i].type == T_FILE && strcmp(ds[i].name, target) == 0) {
+                    printf("%s\n", buf);
+                }
+            }
+        }
         close(fd);
         break;
     }    
@@ -0,0 +1,82 @@
+// Time sequential writes and reads of a file. Run it on images
+// made with FSBSIZE=1024 and FSBSIZE=4096 to compare the two
+// block sizes, and with a large chunk size to see how large
+// write()s fare. Rates assume the usual 10 ticks a second.
+//
+// usage: fsbench [kbytes [chunk-kbytes]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+#define NREAD 8
+
+char *buf;
+
+// Print kb kilobytes in t ticks as KB/s.
+void
+rate(char *what, int kb, int t)
+{
+  if(t == 0)
+    t = 1;
+  printf("%s %d KB: %d ticks, %d KB/s\n", what, kb, t, kb * 10 / t);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, kb, chunk, fd, t0, t;
+
+  kb = 200;
+  chunk = 4;
+  if(argc > 1)
+    kb = atoi(argv[1]);
+  if(argc > 2)
+    chunk = atoi(argv[2]);
+  if(chunk < 1 || kb < chunk){
+    fprintf(2, "usage: fsbench [kbytes [chunk-kbytes]], kbytes >= chunk >= 1\n");
+    exit(1);
+  }
+  n = kb / chunk;
+  chunk *= 1024;
+  if((buf = malloc(chunk)) == 0){
+    fprintf(2, "fsbench: out of memory\n");
+    exit(1);
+  }
+  for(i = 0; i < chunk; i++)
+    buf[i] = i;
+
+  unlink("fsbench.tmp");
+  if((fd = open("fsbench.tmp", O_CREATE|O_RDWR)) < 0){
+    fprintf(2, "fsbench: cannot create fsbench.tmp\n");
+    exit(1);
+  }
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(write(fd, buf, chunk) != chunk){
+      fprintf(2, "fsbench: write failed after %d KB\n", i * chunk / 1024);
+      exit(1);
+    }
+  }
+  fsync(fd);
+  close(fd);
+  t = uptime() - t0;
+  rate("write", n * chunk / 1024, t);
+
+  t0 = uptime();
+  for(i = 0; i < NREAD; i++){
+    if((fd = open("fsbench.tmp", O_RDONLY)) < 0){
+      fprintf(2, "fsbench: cannot open fsbench.tmp\n");
+      exit(1);
+    }
+    while(read(fd, buf, chunk) == chunk)
+      ;
+    close(fd);
+  }
+  t = uptime() - t0;
+  rate("read", NREAD * n * chunk / 1024, t);
+
+  unlink("fsbench.tmp");
+  exit(0);
+}
@@ -0,0 +1,81 @@
+// Measure the scheduling latency of an interactive process
+// while CPU-bound processes compete for the CPUs: start n
+// spinners, at the given nice value, then repeatedly sleep for
+// a few milliseconds and see how much later than asked each
+// sleep ends, which is how long the woken process waits for a
+// CPU. Also report the CPU time that the spinners got.
+//
+// usage: latency [n [nice]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define ROUNDS 50
+#define NAPNS 5000000      // 5 ms
+#define SPINNS 1000000000  // how long the spinners run
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, nice, pid, xstatus, spun;
+  uint64 end, t0, t1, late, sum, max;
+  volatile int x;
+
+  n = 4;
+  nice = 0;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(argc > 2)
+    nice = atoi(argv[2]);
+  if(n < 0 || n > NPROC - 8 || nice < 0 || nice > NICEMAX){
+    fprintf(2, "usage: latency [n [nice]], n <= %d, nice <= %d\n",
+            NPROC - 8, NICEMAX);
+    exit(1);
+  }
+
+  end = uptimens() + SPINNS;
+  for(i = 0; i < n; i++){
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "latency: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      // exit with the CPU time used, in ms.
+      setpriority(0, nice);
+      while(uptimens() < end)
+        for(x = 0; x < 10000; x++)
+          ;
+      exit(cputime() / 1000000);
+    }
+  }
+
+  // give the spinners time to use up their quanta.
+  sleepns(200000000);
+
+  sum = max = 0;
+  for(i = 0; i < ROUNDS; i++){
+    t0 = uptimens();
+    sleepns(NAPNS);
+    t1 = uptimens();
+    late = t1 - t0 - NAPNS;
+    sum += late;
+    if(late > max)
+      max = late;
+  }
+  if(uptimens() > end)
+    printf("latency: warning: spinners finished first\n");
+
+  spun = 0;
+  for(i = 0; i < n; i++){
+    wait(&xstatus);
+    spun += xstatus;
+  }
+
+  printf("%d spinners at nice %d: wakeup latency avg %d us, max %d us\n",
+         n, nice, (int)(sum / ROUNDS / 1000), (int)(max / 1000));
+  printf("spinners used %d ms of cpu\n", spun);
+  exit(0);
+}
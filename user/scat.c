@@ -0,0 +1,40 @@
+// cat, but the data moves from file to output inside the
+// kernel, with splice(), rather than through a user buffer.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+void
+scat(int fd)
+{
+  int n;
+
+  while((n = splice(fd, 1, 1 << 20)) > 0)
+    ;
+  if(n < 0){
+    fprintf(2, "scat: splice error\n");
+    exit(1);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i;
+
+  if(argc <= 1){
+    scat(0);
+    exit(0);
+  }
+
+  for(i = 1; i < argc; i++){
+    if((fd = open(argv[i], 0)) < 0){
+      fprintf(2, "scat: cannot open %s\n", argv[i]);
+      exit(1);
+    }
+    scat(fd);
+    close(fd);
+  }
+  exit(0);
+}
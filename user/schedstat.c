@@ -0,0 +1,72 @@
+// Print each CPU's scheduling statistics: its run queue length,
+// context switches, processes stolen from other CPUs' run
+// queues, and time spent idle. Given n, first run n CPU-bound processes for a few
+// seconds and print the statistics for just that time.
+//
+// usage: schedstat [n]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define RUNTICKS 30
+
+struct cpustat before[NCPU], after[NCPU];
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, n, nb, na, t0;
+  volatile int x;
+
+  n = 0;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 0 || n > NPROC - 8){
+    fprintf(2, "usage: schedstat [n], 0 <= n <= %d\n", NPROC - 8);
+    exit(1);
+  }
+
+  nb = cpustat(before, NCPU);
+  if(nb < 0){
+    fprintf(2, "schedstat: cpustat failed\n");
+    exit(1);
+  }
+  if(n > 0){
+    for(i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "schedstat: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        t0 = uptime();
+        while(uptime() - t0 < RUNTICKS)
+          for(x = 0; x < 10000; x++)
+            ;
+        exit(0);
+      }
+    }
+    for(i = 0; i < n; i++)
+      wait(0);
+  } else {
+    nb = 0;  // totals since boot
+  }
+  na = cpustat(after, NCPU);
+
+  printf("cpu  runq  switches  steals  idle(ms)\n");
+  for(i = 0; i < na; i++){
+    for(j = 0; j < nb && before[j].cpu != after[i].cpu; j++)
+      ;
+    if(j < nb){
+      after[i].nswtch -= before[j].nswtch;
+      after[i].nsteal -= before[j].nsteal;
+      after[i].idlens -= before[j].idlens;
+    }
+    printf("%d    %d     %d      %d       %d\n", after[i].cpu, after[i].rqlen,
+           (int)after[i].nswtch, (int)after[i].nsteal,
+           (int)(after[i].idlens / 1000000));
+  }
+  exit(0);
+}
@@ -1,4 +1,7 @@
 struct stat;
+struct dirstat;
+struct cpustat;
+struct logstat;
 struct rtcdate;
 
 // system calls
@@ -23,6 +26,19 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int getdents(int, struct dirstat*, int, int);
+int lseek(int, int, int);
+int fallocate(int, int, int, int);
+int copy_file_range(int, int, int);
+int splice(int, int, int);
+int fsync(int);
+int fdatasync(int);
+int cpustat(struct cpustat*, int);
+uint64 uptimens(void);
+int sleepns(uint64);
+int setpriority(int, int);
+uint64 cputime(void);
+int logstat(struct logstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -19,6 +19,10 @@
 
 #define BUFSZ  ((MAXOPBLOCKS+2)*BSIZE)
 
+// largest file, in BSIZE blocks, on a file system with the
+// default block size; larger block sizes allow larger files.
+#define MAXFILEBLK (NDIRECT + BSIZE / sizeof(uint))
+
 char buf[BUFSZ];
 
 // what if you pass ridiculous pointers to system calls
@@ -412,6 +416,57 @@ truncate3(char *s)
   unlink("truncfile");
   exit(xstatus);
 }
+
+// O_TRUNC and unlink of files large enough that their
+// blocks are freed in the background.
+void
+truncbig(char *s)
+{
+  // Enough rounds to write more blocks than are free (see
+  // badwrite), so blocks that truncation fails to free run the
+  // file system out of space.
+  enum { NROUND = 16 };
+  int fd, i, round;
+
+  for(round = 0; round < NROUND; round++){
+    fd = open("truncbig", O_CREATE|O_RDWR|O_TRUNC);
+    if(fd < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    if(read(fd, buf, 1) != 0){
+      printf("%s: O_TRUNC left data\n", s);
+      exit(1);
+    }
+    for(i = 0; i < 8; i++){
+      memset(buf, 'a' + round, 5000);
+      if(write(fd, buf, 5000) != 5000){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+    // fsync() frees the old blocks, if the writeback
+    // thread has not already.
+    if(fsync(fd) != 0){
+      printf("%s: fsync failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  fd = open("truncbig", O_RDONLY);
+  for(i = 0; i < 8; i++){
+    if(read(fd, buf, 5000) != 5000 || buf[0] != 'a' + NROUND - 1 ||
+       buf[4999] != 'a' + NROUND - 1){
+      printf("%s: wrong data\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(unlink("truncbig") != 0 || open("truncbig", O_RDONLY) >= 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+}
   
 
 // does chdir() call iput(p->cwd) in a transaction?
@@ -580,7 +635,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < MAXFILEBLK; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -600,7 +655,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == MAXFILEBLK - 1){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -865,6 +920,336 @@ preempt(char *s)
   wait(0);
 }
 
+// More CPU-bound processes than CPUs, all started on this one's
+// run queue: each must be switched to at least once, the other
+// CPUs must steal some of them, and every queue drains when they
+// exit.
+void
+runqueues(char *s)
+{
+  struct cpustat st[NCPU];
+  uint64 swtch0, steal0, swtch1, steal1;
+  int i, n, nchild, pid, t0, tries, queued;
+  volatile int x;
+
+  n = cpustat(st, NCPU);
+  if(n < 1 || n > NCPU){
+    printf("%s: cpustat returned %d\n", s, n);
+    exit(1);
+  }
+  swtch0 = steal0 = 0;
+  for(i = 0; i < n; i++){
+    swtch0 += st[i].nswtch;
+    steal0 += st[i].nsteal;
+  }
+
+  nchild = n + 2;
+  for(i = 0; i < nchild; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      t0 = uptime();
+      while(uptime() - t0 < 5)
+        for(x = 0; x < 1000; x++)
+          ;
+      exit(0);
+    }
+  }
+  for(i = 0; i < nchild; i++)
+    wait(0);
+
+  // Other processes may be queued for a moment as they wake.
+  for(tries = 0; ; tries++){
+    if(cpustat(st, NCPU) != n){
+      printf("%s: cpustat changed\n", s);
+      exit(1);
+    }
+    queued = 0;
+    for(i = 0; i < n; i++)
+      queued += st[i].rqlen;
+    if(queued == 0)
+      break;
+    if(tries == 10){
+      for(i = 0; i < n; i++)
+        if(st[i].rqlen != 0)
+          printf("%s: cpu %d run queue length %d\n", s, st[i].cpu, st[i].rqlen);
+      exit(1);
+    }
+    sleep(1);
+  }
+
+  swtch1 = steal1 = 0;
+  for(i = 0; i < n; i++){
+    swtch1 += st[i].nswtch;
+    steal1 += st[i].nsteal;
+  }
+  if(swtch1 < swtch0 + nchild){
+    printf("%s: only %d switches\n", s, (int)(swtch1 - swtch0));
+    exit(1);
+  }
+  if(n > 1 && steal1 == steal0){
+    printf("%s: no steals with %d cpus\n", s, n);
+    exit(1);
+  }
+}
+
+// many processes asleep on one pipe: kill some of them, then
+// wake the rest one byte at a time.
+void
+sleepers(char *s)
+{
+  enum { N = 16 };
+  int fds[2], pids[N], i, xstatus;
+  char c;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      close(fds[1]);
+      if(read(fds[0], &c, 1) != 1)
+        exit(1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  sleep(2);
+
+  for(i = 0; i < N; i += 2)
+    kill(pids[i]);
+  for(i = 0; i < N/2; i++){
+    if(wait(&xstatus) < 0){
+      printf("%s: wait failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N/2; i++){
+    if(write(fds[1], "x", 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N/2; i++){
+    if(wait(&xstatus) < 0 || xstatus != 0){
+      printf("%s: sleeper did not wake\n", s);
+      exit(1);
+    }
+  }
+  close(fds[1]);
+}
+
+// sleep(n) lasts at least n ticks, even with other processes
+// sleeping for other times, and kill() cuts a sleep short.
+void
+sleeptimes(char *s)
+{
+  int i, pid, t0, t1, xstatus;
+
+  for(i = 1; i <= 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      t0 = uptime();
+      sleep(3*i);
+      exit(uptime() - t0 < 3*i);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: woke up early\n", s);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(100000);
+    exit(0);
+  }
+  sleep(2);
+  t0 = uptime();
+  kill(pid);
+  wait(&xstatus);
+  t1 = uptime();
+  if(xstatus != -1 || t1 - t0 > 10){
+    printf("%s: kill did not end sleep\n", s);
+    exit(1);
+  }
+}
+
+// the nanosecond clock advances, and short sleeps are neither
+// shorter than asked nor rounded up to whole ticks.
+void
+nanosleep(char *s)
+{
+  uint64 t0, t1;
+  int i;
+
+  t0 = uptimens();
+  t1 = uptimens();
+  if(t1 < t0 || t0 / 100000000 > uptime() + 1){
+    printf("%s: bad clock %d %d\n", s, (int)(t0/1000), (int)(t1/1000));
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    t0 = uptimens();
+    if(sleepns(2000000) < 0){
+      printf("%s: sleepns failed\n", s);
+      exit(1);
+    }
+    t1 = uptimens();
+    if(t1 - t0 < 2000000){
+      printf("%s: slept %d us, not 2000\n", s, (int)((t1-t0)/1000));
+      exit(1);
+    }
+  }
+  t0 = uptimens();
+  for(i = 0; i < 10; i++)
+    sleepns(1000000);
+  t1 = uptimens();
+  if(t1 - t0 > 500000000){
+    printf("%s: 10 1ms sleeps took %d ms\n", s, (int)((t1-t0)/1000000));
+    exit(1);
+  }
+}
+
+// while this process sleeps, the cpus should be idle, and not
+// for longer than the time that passes.
+void
+idletime(char *s)
+{
+  struct cpustat st0[NCPU], st1[NCPU];
+  uint64 t0, t1, idle;
+  int i, n;
+
+  n = cpustat(st0, NCPU);
+  t0 = uptimens();
+  sleepns(300000000);
+  t1 = uptimens();
+  if(cpustat(st1, NCPU) != n){
+    printf("%s: cpustat failed\n", s);
+    exit(1);
+  }
+  idle = 0;
+  for(i = 0; i < n; i++){
+    if(st1[i].idlens - st0[i].idlens > t1 - t0){
+      printf("%s: cpu %d idle longer than elapsed\n", s, st1[i].cpu);
+      exit(1);
+    }
+    idle += st1[i].idlens - st0[i].idlens;
+  }
+  if(idle < (t1 - t0) / 2){
+    printf("%s: idle %d ms of %d\n", s, (int)(idle/1000000),
+           (int)((t1-t0)/1000000));
+    exit(1);
+  }
+}
+
+// nice values can be set and read back, and CPU time is
+// counted while a process runs.
+void
+schedprio(char *s)
+{
+  uint64 t0, c0, c1;
+  volatile int x;
+
+  if(setpriority(0, 5) != 0 || setpriority(0, 0) != 5){
+    printf("%s: setpriority did not return old nice value\n", s);
+    exit(1);
+  }
+  if(setpriority(0, -1) != -1 || setpriority(0, NICEMAX+1) != -1){
+    printf("%s: setpriority accepted bad nice value\n", s);
+    exit(1);
+  }
+  if(setpriority(1000000, 0) != -1){
+    printf("%s: setpriority of bad pid succeeded\n", s);
+    exit(1);
+  }
+
+  c0 = cputime();
+  t0 = uptimens();
+  while(uptimens() - t0 < 50000000)
+    for(x = 0; x < 1000; x++)
+      ;
+  c1 = cputime();
+  if(c1 <= c0 || c1 - c0 > uptimens() - t0){
+    printf("%s: cputime went from %d to %d us\n", s,
+           (int)(c0/1000), (int)(c1/1000));
+    exit(1);
+  }
+}
+
+// A CPU-bound process at nice 0 must get most of its CPU while
+// as many CPU-bound processes at nice 19 as there are CPUs run
+// too. With equal shares it would get at most half, since its
+// CPU has at least one of them unless another CPU took it; nice
+// 0 gets twenty times the quantum of nice 19. Wakeup latency is
+// measured by the latency program instead.
+void
+niceshare(char *s)
+{
+  struct cpustat st[NCPU];
+  int pids[NCPU], i, n;
+  uint64 t0, t1, c0, c1;
+  volatile int x;
+
+  n = cpustat(st, NCPU);
+  if(n < 1 || n > NCPU){
+    printf("%s: cpustat returned %d\n", s, n);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      setpriority(0, NICEMAX);
+      for(;;)
+        for(x = 0; x < 1000; x++)
+          ;
+    }
+  }
+  sleepns(100000000);
+
+  c0 = cputime();
+  t0 = uptimens();
+  while(uptimens() - t0 < 500000000)
+    for(x = 0; x < 1000; x++)
+      ;
+  c1 = cputime();
+  t1 = uptimens();
+
+  for(i = 0; i < n; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+  if(3*(c1 - c0) < 2*(t1 - t0)){
+    printf("%s: got %d ms of cpu in %d ms\n", s,
+           (int)((c1 - c0) / 1000000), (int)((t1 - t0) / 1000000));
+    exit(1);
+  }
+}
+
 // try to find any races between exit and wait
 void
 exitwait(char *s)
@@ -1553,75 +1938,780 @@ bigdir(char *s)
   }
 }
 
+// a directory big enough to be hash-indexed must still
+// read back as a plain array of dirents.
 void
-subdir(char *s)
+dirindex(char *s)
 {
-  int fd, cc;
+  enum { N = 300 };
+  int i, fd, n;
+  char name[8], seen[N];
+  struct dirent de;
 
-  unlink("ff");
-  if(mkdir("dd") != 0){
-    printf("%s: mkdir dd failed\n", s);
+  if(mkdir("di") < 0 || chdir("di") < 0){
+    printf("%s: mkdir di failed\n", s);
     exit(1);
   }
-
-  fd = open("dd/ff", O_CREATE | O_RDWR);
-  if(fd < 0){
-    printf("%s: create dd/ff failed\n", s);
+  if((fd = open("t", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create di/t failed\n", s);
     exit(1);
   }
-  write(fd, "ff", 2);
   close(fd);
+  name[0] = 'x';
+  name[3] = '\0';
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if(link("t", name) < 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += 2){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    fd = open(name, O_RDONLY);
+    if((fd >= 0) != (i % 2 == 1)){
+      printf("%s: open %s wrong\n", s, name);
+      exit(1);
+    }
+    if(fd >= 0)
+      close(fd);
+  }
 
-  if(unlink("dd") >= 0){
-    printf("%s: unlink dd (non-empty dir) succeeded!\n", s);
+  memset(seen, 0, sizeof(seen));
+  n = 0;
+  if((fd = open(".", O_RDONLY)) < 0){
+    printf("%s: open di failed\n", s);
     exit(1);
   }
-
-  if(mkdir("/dd/dd") != 0){
-    printf("subdir mkdir dd/dd failed\n", s);
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum == 0 || de.name[0] != 'x')
+      continue;
+    i = (de.name[1] - '0') * 64 + (de.name[2] - '0');
+    if(i < 0 || i >= N || i % 2 == 0 || seen[i]){
+      printf("%s: bad entry %s\n", s, de.name);
+      exit(1);
+    }
+    seen[i] = 1;
+    n++;
+  }
+  close(fd);
+  if(n != N/2){
+    printf("%s: read %d entries, wanted %d\n", s, n, N/2);
     exit(1);
   }
 
-  fd = open("dd/dd/ff", O_CREATE | O_RDWR);
-  if(fd < 0){
-    printf("%s: create dd/dd/ff failed\n", s);
+  for(i = 1; i < N; i += 2){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  unlink("t");
+  chdir("..");
+  if(unlink("di") < 0){
+    printf("%s: unlink di failed\n", s);
     exit(1);
   }
-  write(fd, "FF", 2);
-  close(fd);
+}
 
-  fd = open("dd/dd/../ff", 0);
-  if(fd < 0){
-    printf("%s: open dd/dd/../ff failed\n", s);
+// getdents() returns each live entry once, with its type
+// and size, in batches no larger than asked for.
+void
+getdentstest(char *s)
+{
+  struct dirstat ds[2];
+  int fd, i, n, nfile, ndir;
+
+  if(mkdir("gdd") < 0 || mkdir("gdd/sub") < 0){
+    printf("%s: mkdir failed\n", s);
     exit(1);
   }
-  cc = read(fd, buf, sizeof(buf));
-  if(cc != 2 || buf[0] != 'f'){
-    printf("%s: dd/dd/../ff wrong content\n", s);
+  fd = open("gdd/f", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "abc", 3) != 3){
+    printf("%s: create gdd/f failed\n", s);
+    exit(1);
+  }
+  if(getdents(fd, ds, 2, GD_STAT) != -1){
+    printf("%s: getdents on a file succeeded\n", s);
     exit(1);
   }
   close(fd);
-
-  if(link("dd/dd/ff", "dd/dd/ffff") != 0){
-    printf("link dd/dd/ff dd/dd/ffff failed\n", s);
+  if(link("gdd/f", "gdd/g") < 0){
+    printf("%s: link failed\n", s);
     exit(1);
   }
 
-  if(unlink("dd/dd/ff") != 0){
-    printf("%s: unlink dd/dd/ff failed\n", s);
+  nfile = ndir = 0;
+  fd = open("gdd", O_RDONLY);
+  while((n = getdents(fd, ds, 2, GD_STAT)) > 0){
+    for(i = 0; i < n; i++){
+      if(ds[i].type == T_DIR){
+        ndir++;
+      } else if(ds[i].type == T_FILE && ds[i].size == 3 &&
+                (strcmp(ds[i].name, "f") == 0 || strcmp(ds[i].name, "g") == 0)){
+        nfile++;
+      } else {
+        printf("%s: bad entry %s type %d size %d\n", s, ds[i].name, ds[i].type, ds[i].size);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  if(n != 0 || nfile != 2 || ndir != 3){
+    printf("%s: got %d files %d dirs\n", s, nfile, ndir);
     exit(1);
   }
-  if(open("dd/dd/ff", O_RDONLY) >= 0){
-    printf("%s: open (unlinked) dd/dd/ff succeeded\n", s);
+
+  unlink("gdd/f");
+  unlink("gdd/g");
+  unlink("gdd/sub");
+  if(unlink("gdd") < 0){
+    printf("%s: unlink gdd failed\n", s);
     exit(1);
   }
+}
 
-  if(chdir("dd") != 0){
-    printf("%s: chdir dd failed\n", s);
+// a small file is stored inline in its inode; it must read
+// back intact, and survive growing out of the inode and
+// being truncated back into it.
+void
+inlinefile(char *s)
+{
+  int fd, i;
+
+  for(i = 0; i < 2000; i++)
+    buf[i] = 'a' + i % 26;
+  fd = open("inl", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, 30) != 30 || write(fd, buf+30, 10) != 10){
+    printf("%s: small write failed\n", s);
     exit(1);
   }
-  if(chdir("dd/../../dd") != 0){
-    printf("%s: chdir dd/../../dd failed\n", s);
+  close(fd);
+  fd = open("inl", O_RDWR);
+  if(read(fd, buf+2000, 100) != 40 || memcmp(buf, buf+2000, 40) != 0){
+    printf("%s: small read wrong\n", s);
+    exit(1);
+  }
+  if(write(fd, buf+40, 1960) != 1960){
+    printf("%s: grow failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("inl", O_RDONLY);
+  if(read(fd, buf+2000, 2000) != 2000 || memcmp(buf, buf+2000, 2000) != 0){
+    printf("%s: read after grow wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("inl", O_RDWR|O_TRUNC);
+  if(write(fd, "xyz", 3) != 3){
+    printf("%s: write after truncate failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("inl", O_RDONLY);
+  if(read(fd, buf+2000, 100) != 3 || memcmp("xyz", buf+2000, 3) != 0){
+    printf("%s: read after truncate wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("inl");
+}
+
+// a file written after seeking past its end has a hole
+// that reads as zeroes; fallocate() can fill holes with
+// blocks and punch new ones.
+void
+sparsefile(char *s)
+{
+  int fd, i;
+
+  fd = open("sparse", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create sparse failed\n", s);
+    exit(1);
+  }
+  if(lseek(fd, 100000, SEEK_SET) != 100000 || write(fd, "end", 3) != 3){
+    printf("%s: write past end failed\n", s);
+    exit(1);
+  }
+  if(lseek(fd, 0, SEEK_END) != 100003 || lseek(fd, -1, SEEK_SET) != -1){
+    printf("%s: lseek wrong\n", s);
+    exit(1);
+  }
+  lseek(fd, 50000, SEEK_SET);
+  memset(buf, 'x', 4096);
+  if(read(fd, buf, 4096) != 4096){
+    printf("%s: read hole failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4096; i++){
+    if(buf[i] != 0){
+      printf("%s: hole not zero\n", s);
+      exit(1);
+    }
+  }
+
+  if(fallocate(fd, 0, 1000, 8000) != 0){
+    printf("%s: fallocate failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'y', 8000);
+  lseek(fd, 1000, SEEK_SET);
+  if(write(fd, buf, 8000) != 8000){
+    printf("%s: write preallocated failed\n", s);
+    exit(1);
+  }
+  if(fallocate(fd, FALLOC_FL_PUNCH_HOLE, 2000, 3000) != 0){
+    printf("%s: punch failed\n", s);
+    exit(1);
+  }
+  lseek(fd, 1000, SEEK_SET);
+  if(read(fd, buf, 8000) != 8000){
+    printf("%s: read back failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8000; i++){
+    if(buf[i] != (i >= 1000 && i < 4000 ? 0 : 'y')){
+      printf("%s: wrong byte at %d\n", s, 1000 + i);
+      exit(1);
+    }
+  }
+  if(lseek(fd, 0, SEEK_END) != 100003){
+    printf("%s: size changed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("sparse");
+}
+
+// copy_file_range(), and writes to both copies afterwards.
+void
+copyfile(char *s)
+{
+  int a, b, i, n, tot;
+
+  a = open("cfsrc", O_CREATE|O_RDWR);
+  b = open("cfdst", O_CREATE|O_RDWR);
+  if(a < 0 || b < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8000; i++)
+    buf[i] = 'a' + i % 26;
+  for(i = 0; i < 10; i++){
+    if(write(a, buf, 8000) != 8000){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  if(copy_file_range(a, a, 100) != -1){
+    printf("%s: copy to self succeeded\n", s);
+    exit(1);
+  }
+  lseek(a, 0, SEEK_SET);
+  tot = 0;
+  while((n = copy_file_range(a, b, 100000)) > 0)
+    tot += n;
+  if(n < 0 || tot != 80000){
+    printf("%s: copied %d bytes\n", s, tot);
+    exit(1);
+  }
+
+  // Overwrite the start of each copy; neither may see the other's data.
+  lseek(a, 0, SEEK_SET);
+  lseek(b, 0, SEEK_SET);
+  memset(buf, 'A', 5000);
+  write(a, buf, 5000);
+  memset(buf, 'B', 5000);
+  write(b, buf, 5000);
+  lseek(a, 0, SEEK_SET);
+  lseek(b, 0, SEEK_SET);
+  for(i = 0; i < 80000; i += 8000){
+    if(read(b, buf, 8000) != 8000){
+      printf("%s: read copy failed\n", s);
+      exit(1);
+    }
+    for(n = 0; n < 8000; n++){
+      if(buf[n] != (i + n < 5000 ? 'B' : 'a' + n % 26)){
+        printf("%s: copy wrong at %d\n", s, i + n);
+        exit(1);
+      }
+    }
+    if(read(a, buf, 8000) != 8000 || buf[0] != (i == 0 ? 'A' : 'a')){
+      printf("%s: source changed\n", s);
+      exit(1);
+    }
+  }
+  close(a);
+  close(b);
+  unlink("cfsrc");
+  unlink("cfdst");
+}
+
+// Write over blocks that have just been freed or unshared, and
+// check that the new file reads back what was written. Whether,
+// on a file system made with FSORDERED=1, such writes go through
+// the log rather than in place would show only after a crash,
+// which this does not test.
+void
+unsharedwrite(char *s)
+{
+  int a, b, i, n;
+
+  a = open("uwa", O_CREATE|O_RDWR);
+  b = open("uwb", O_CREATE|O_RDWR);
+  if(a < 0 || b < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', BSIZE);
+  for(i = 0; i < 8; i++){
+    if(write(a, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  fsync(a);
+  lseek(a, 0, SEEK_SET);
+  if(copy_file_range(a, b, 8*BSIZE) != 8*BSIZE){
+    printf("%s: copy failed\n", s);
+    exit(1);
+  }
+  fsync(b);
+
+  // Drop b's references, then overwrite a's now unshared blocks,
+  // and free those of a for the blocks of a new file.
+  close(b);
+  unlink("uwb");
+  lseek(a, 0, SEEK_SET);
+  memset(buf, 'A', BSIZE);
+  for(i = 0; i < 8; i++)
+    write(a, buf, BSIZE);
+  close(a);
+  unlink("uwa");
+  b = open("uwb", O_CREATE|O_RDWR);
+  memset(buf, 'B', BSIZE);
+  for(i = 0; i < 8; i++)
+    write(b, buf, BSIZE);
+  if(fsync(b) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+
+  lseek(b, 0, SEEK_SET);
+  for(i = 0; i < 8; i++){
+    if(read(b, buf, BSIZE) != BSIZE){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(n = 0; n < BSIZE; n++){
+      if(buf[n] != 'B'){
+        printf("%s: wrong data at %d\n", s, i*BSIZE + n);
+        exit(1);
+      }
+    }
+  }
+  close(b);
+  unlink("uwb");
+}
+
+// On a file system made with FSCOMPRESS=1, programs are stored
+// compressed: they cannot be opened for writing, but must read
+// back the same at any offset, and run. Elsewhere only the reads
+// and exec are checked.
+void
+compressed(char *s)
+{
+  int fd, fds[2], pid, xst, n, off, m;
+  struct stat st;
+  char *a, *b;
+  char out[8];
+  char *args[] = { "echo", "zok", 0 };
+
+  if((fd = open("echo", O_WRONLY)) >= 0){
+    // Not compressed: only the reads and exec are checked.
+    close(fd);
+  } else if(open("echo", O_RDONLY|O_TRUNC) >= 0){
+    printf("%s: truncated a compressed file\n", s);
+    exit(1);
+  }
+
+  fd = open("echo", O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0){
+    printf("%s: open echo failed\n", s);
+    exit(1);
+  }
+  a = malloc(st.size);
+  b = malloc(st.size);
+  if(a == 0 || b == 0){
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  for(off = 0; (n = read(fd, a + off, st.size - off)) > 0; off += n)
+    ;
+  if(off != st.size || read(fd, b, 1) != 0 || memcmp(a, "\x7f" "ELF", 4) != 0){
+    printf("%s: read %d of %d bytes\n", s, off, (int)st.size);
+    exit(1);
+  }
+
+  // Again, backwards, in pieces that straddle cluster boundaries.
+  memset(b, 0, st.size);
+  for(off = st.size; off > 0; off -= m){
+    m = 1 + off % 5003;
+    if(m > off)
+      m = off;
+    if(lseek(fd, off - m, SEEK_SET) != off - m ||
+       read(fd, b + off - m, m) != m){
+      printf("%s: read at %d failed\n", s, off - m);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(memcmp(a, b, st.size) != 0){
+    printf("%s: reads disagree\n", s);
+    exit(1);
+  }
+  free(a);
+  free(b);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    dup(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    exec("echo", args);
+    exit(1);
+  }
+  close(fds[1]);
+  n = read(fds[0], out, sizeof(out));
+  close(fds[0]);
+  wait(&xst);
+  if(xst != 0 || n != 4 || memcmp(out, "zok\n", 4) != 0){
+    printf("%s: exec echo failed\n", s);
+    exit(1);
+  }
+}
+
+// Files written with the same blocks, which share them on a file
+// system made with FSDEDUP=1: writing one must not change the
+// other, and the blocks of zeroes of one must not be shared with
+// an indirect block of another that happens to be all zero.
+void
+dedupwrite(char *s)
+{
+  enum { N = NDIRECT + 4 };
+  int a, b, c, i, n;
+
+  a = open("dwa", O_CREATE|O_RDWR);
+  b = open("dwb", O_CREATE|O_RDWR);
+  c = open("dwc", O_CREATE|O_RDWR);
+  if(a < 0 || b < 0 || c < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i, BSIZE);
+    if(write(a, buf, BSIZE) != BSIZE || write(b, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  lseek(b, 0, SEEK_SET);
+  memset(buf, 'B', BSIZE);
+  for(i = 0; i < N; i++)
+    write(b, buf, BSIZE);
+
+  // Leave a's indirect block all zero, fill c with zeroes, then
+  // have a's indirect block point at new blocks again.
+  if(fallocate(a, FALLOC_FL_PUNCH_HOLE, NDIRECT*BSIZE, 4*BSIZE) != 0){
+    printf("%s: punch failed\n", s);
+    exit(1);
+  }
+  memset(buf, 0, BSIZE);
+  for(i = 0; i < N; i++)
+    write(c, buf, BSIZE);
+  lseek(a, NDIRECT*BSIZE, SEEK_SET);
+  memset(buf, 'p', BSIZE);
+  for(i = NDIRECT; i < N; i++)
+    write(a, buf, BSIZE);
+
+  lseek(a, 0, SEEK_SET);
+  lseek(b, 0, SEEK_SET);
+  lseek(c, 0, SEEK_SET);
+  for(i = 0; i < N; i++){
+    if(read(a, buf, BSIZE) != BSIZE ||
+       read(b, buf + BSIZE, BSIZE) != BSIZE ||
+       read(c, buf + 2*BSIZE, BSIZE) != BSIZE){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(n = 0; n < BSIZE; n++){
+      if(buf[n] != (i < NDIRECT ? 'a' + i : 'p') ||
+         buf[BSIZE + n] != 'B' || buf[2*BSIZE + n] != 0){
+        printf("%s: block %d wrong\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  close(a);
+  close(b);
+  close(c);
+  unlink("dwa");
+  unlink("dwb");
+  unlink("dwc");
+}
+
+// splice() from a file into a pipe, and from the pipe into another file.
+void
+splicepipe(char *s)
+{
+  int fd, fds[2], i, n, pid, xst;
+
+  fd = open("spsrc", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 5000; i++)
+    buf[i] = i % 251;
+  for(i = 0; i < 4; i++)
+    write(fd, buf, 5000);
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fd = open("spsrc", O_RDONLY);
+    if(splice(fd, fds[1], 100000) != 20000)
+      exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  fd = open("spdst", O_CREATE|O_RDWR);
+  n = 0;
+  while((i = splice(fds[0], fd, 3000)) > 0)
+    n += i;
+  close(fds[0]);
+  wait(&xst);
+  if(xst != 0 || n != 20000){
+    printf("%s: spliced %d bytes\n", s, n);
+    exit(1);
+  }
+  lseek(fd, 0, SEEK_SET);
+  for(i = 0; i < 4; i++){
+    if(read(fd, buf, 5000) != 5000){
+      printf("%s: short read\n", s);
+      exit(1);
+    }
+    for(n = 0; n < 5000; n++){
+      if((uchar)buf[n] != n % 251){
+        printf("%s: wrong data\n", s);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  unlink("spsrc");
+  unlink("spdst");
+}
+
+// splice() from a pipe returns what is there, as read() does,
+// rather than waiting for the whole count.
+void
+splicepartial(char *s)
+{
+  int fd, in[2], ack[2], pid, n, xst;
+  char c;
+
+  if(pipe(in) != 0 || pipe(ack) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(in[0]);
+    close(ack[1]);
+    write(in[1], "0123456789", 10);
+    // Hold the pipe open until the parent has spliced.
+    read(ack[0], &c, 1);
+    exit(0);
+  }
+  close(in[1]);
+  close(ack[0]);
+  fd = open("sppart", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  n = splice(in[0], fd, 1000);
+  write(ack[1], "x", 1);
+  close(ack[1]);
+  close(in[0]);
+  close(fd);
+  wait(&xst);
+  unlink("sppart");
+  if(n != 10){
+    printf("%s: spliced %d bytes, wanted 10\n", s, n);
+    exit(1);
+  }
+}
+
+// fsync() and fdatasync() on files, directories and pipes.
+// After a write, each must commit a transaction, unless the
+// writeback thread already has committed the write.
+void
+fsynctest(char *s)
+{
+  int fd, fds[2], i, r;
+  struct logstat ls0, ls1;
+
+  fd = open("fsyncf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync file failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    if(write(fd, "hello", 5) != 5 || logstat(&ls0) != 0){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    r = i == 0 ? fdatasync(fd) : fsync(fd);
+    if(r != 0 || logstat(&ls1) != 0){
+      printf("%s: fsync file failed\n", s);
+      exit(1);
+    }
+    if(ls0.nblock > 0 && ls1.ncommit == ls0.ncommit){
+      printf("%s: %s committed nothing\n", s, i == 0 ? "fdatasync" : "fsync");
+      exit(1);
+    }
+  }
+  close(fd);
+  fd = open(".", O_RDONLY);
+  if(fsync(fd) != 0){
+    printf("%s: fsync dir failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[1]) != -1 || fsync(-1) != -1){
+    printf("%s: fsync of non-file succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("fsyncf");
+}
+
+void
+subdir(char *s)
+{
+  int fd, cc;
+
+  unlink("ff");
+  if(mkdir("dd") != 0){
+    printf("%s: mkdir dd failed\n", s);
+    exit(1);
+  }
+
+  fd = open("dd/ff", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create dd/ff failed\n", s);
+    exit(1);
+  }
+  write(fd, "ff", 2);
+  close(fd);
+
+  if(unlink("dd") >= 0){
+    printf("%s: unlink dd (non-empty dir) succeeded!\n", s);
+    exit(1);
+  }
+
+  if(mkdir("/dd/dd") != 0){
+    printf("subdir mkdir dd/dd failed\n", s);
+    exit(1);
+  }
+
+  fd = open("dd/dd/ff", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create dd/dd/ff failed\n", s);
+    exit(1);
+  }
+  write(fd, "FF", 2);
+  close(fd);
+
+  fd = open("dd/dd/../ff", 0);
+  if(fd < 0){
+    printf("%s: open dd/dd/../ff failed\n", s);
+    exit(1);
+  }
+  cc = read(fd, buf, sizeof(buf));
+  if(cc != 2 || buf[0] != 'f'){
+    printf("%s: dd/dd/../ff wrong content\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(link("dd/dd/ff", "dd/dd/ffff") != 0){
+    printf("link dd/dd/ff dd/dd/ffff failed\n", s);
+    exit(1);
+  }
+
+  if(unlink("dd/dd/ff") != 0){
+    printf("%s: unlink dd/dd/ff failed\n", s);
+    exit(1);
+  }
+  if(open("dd/dd/ff", O_RDONLY) >= 0){
+    printf("%s: open (unlinked) dd/dd/ff succeeded\n", s);
+    exit(1);
+  }
+
+  if(chdir("dd") != 0){
+    printf("%s: chdir dd failed\n", s);
+    exit(1);
+  }
+  if(chdir("dd/../../dd") != 0){
+    printf("%s: chdir dd/../../dd failed\n", s);
     exit(1);
   }
   if(chdir("dd/../../../dd") != 0){
@@ -2040,6 +3130,76 @@ iref(char *s)
   chdir("/");
 }
 
+// have more inodes open at once than the initial size of
+// the kernel's inode table.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD = 6, NF = 12 };
+  int i, j, pid, fd, xstatus;
+  int ready[2], done[2];
+  char name[8], c;
+
+  if(pipe(ready) < 0 || pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(done[1]);
+      name[0] = 'i';
+      name[1] = 'a' + i;
+      name[3] = '\0';
+      for(j = 0; j < NF; j++){
+        name[2] = 'a' + j;
+        if((fd = open(name, O_CREATE|O_RDWR)) < 0 || write(fd, name, 3) != 3){
+          printf("%s: create %s failed\n", s, name);
+          write(ready[1], "f", 1);
+          exit(1);
+        }
+      }
+      write(ready[1], "x", 1);
+      read(done[0], &c, 1);  // hold the files open until the parent says
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(done[0]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1 || c != 'x'){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(done[1]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  close(ready[0]);
+
+  name[0] = 'i';
+  name[3] = '\0';
+  for(i = 0; i < NCHILD; i++){
+    name[1] = 'a' + i;
+    for(j = 0; j < NF; j++){
+      name[2] = 'a' + j;
+      if((fd = open(name, O_RDONLY)) < 0 || read(fd, &c, 1) != 1 || c != 'i'){
+        printf("%s: reopen %s failed\n", s, name);
+        exit(1);
+      }
+      close(fd);
+      unlink(name);
+    }
+  }
+}
+
 // test that fork fails gracefully
 // the forktest binary also does this, but it runs out of proc entries first.
 // inside the bigger usertests binary, we run out of memory first.
@@ -2830,6 +3990,7 @@ main(int argc, char *argv[])
     {truncate1, "truncate1"},
     {truncate2, "truncate2"},
     {truncate3, "truncate3"},
+    {truncbig, "truncbig"},
     {reparent2, "reparent2"},
     {pgbug, "pgbug" },
     {sbrkbugs, "sbrkbugs" },
@@ -2846,6 +4007,17 @@ main(int argc, char *argv[])
     {unlinkread, "unlinkread"},
     {concreate, "concreate"},
     {subdir, "subdir"},
+    {dirindex, "dirindex"},
+    {getdentstest, "getdents"},
+    {inlinefile, "inlinefile"},
+    {sparsefile, "sparsefile"},
+    {copyfile, "copyfile"},
+    {unsharedwrite, "unsharedwrite"},
+    {dedupwrite, "dedupwrite"},
+    {compressed, "compressed"},
+    {splicepipe, "splicepipe"},
+    {splicepartial, "splicepartial"},
+    {fsynctest, "fsynctest"},
     {fourfiles, "fourfiles"},
     {sharedfd, "sharedfd"},
     {dirtest, "dirtest"},
@@ -2873,12 +4045,20 @@ main(int argc, char *argv[])
     {pipe1, "pipe1"},
     {killstatus, "killstatus"},
     {preempt, "preempt"},
+    {runqueues, "runqueues"},
+    {sleepers, "sleepers"},
+    {sleeptimes, "sleeptimes"},
+    {nanosleep, "nanosleep"},
+    {idletime, "idletime"},
+    {schedprio, "schedprio"},
+    {niceshare, "niceshare"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},
     {fourteen, "fourteen"},
     {bigfile, "bigfile"},
     {dirfile, "dirfile"},
     {iref, "iref"},
+    {manyinodes, "manyinodes"},
     {forktest, "forktest"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
@@ -36,3 +36,16 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("getdents");
+entry("lseek");
+entry("fallocate");
+entry("copy_file_range");
+entry("splice");
+entry("fsync");
+entry("fdatasync");
+entry("cpustat");
+entry("uptimens");
+entry("sleepns");
+entry("setpriority");
+entry("cputime");
+entry("logstat");